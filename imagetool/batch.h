@@ -0,0 +1,1245 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <pthread.h>
+#include <strings.h>
+
+#include "common.h"
+#include "imageProcess.h"
+#include "threadPool.h"
+#include "cache.h"
+#include "depfile.h"
+
+// main.c pulls in the stb_image implementation
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb/stb_image.h"
+#endif
+
+struct Batch;
+struct BatchSplit;
+
+typedef struct {
+    struct Batch* batch;
+
+    char* inputPath;
+    char* maskPath; // Optional (create)
+    char* outputPath;
+
+    u64 weight; // Rough cost estimate, see BatchWeigh*
+    u64 memPeak; // Estimated peak memory use in bytes, see BatchWeigh*
+
+    int failed;
+    int cached; // Output was copied from the cache
+    char error[256];
+    char note[128]; // Shown after OK, e.g. what --auto picked
+
+    PathList outputs; // Every file the job wrote
+
+    // Mapped .image file (extract). Kept here rather than on the stack so it
+    // survives a panic unwind
+    MappedFile input;
+
+    struct BatchSplit* split; // Set while the job's level tasks are in flight
+} BatchJob;
+
+// One level of a split job (or the mask, for extraction)
+typedef struct {
+    BatchJob* job;
+    u32 index;
+
+    // Extract: the decompressed level, owned by the task
+    u8* data;
+    u32 size;
+} BatchLevelTask;
+
+// An extract job splits into one task per mip level, so idle workers can
+// steal levels of a big texture instead of waiting on it. Each level is
+// submitted as soon as it has been decompressed. A create job builds its
+// levels as a MipChain on the batch pool, which holds one reference until
+// every level is done. The task that finishes last runs the finish
+// function (compress, cache, report) and frees the split.
+typedef struct BatchSplit {
+    u32 pendingTasks; // Atomic; the splitting job holds one until everything is submitted
+    void (*finish)(BatchJob* job, unsigned workerIndex);
+
+    u64 cacheKey;
+
+    // Extract
+    KTXHeader ktxHeader;
+    int haveKTXHeader;
+    char** paths; // Path each task wrote, NULL if it wrote nothing
+
+    // Create
+    u8* maskData;
+    int maskWidth, maskHeight;
+
+    KTXView ktx;
+    MipChain* chain;
+
+    u32 taskCount;
+    BatchLevelTask* tasks;
+} BatchSplit;
+
+// State owned by one worker thread and reused across all of its jobs
+typedef struct {
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+
+    // Source files are read here and decoded from memory
+    // (slot 0 for the input, 1 for the mask)
+    u8* readBuf[2];
+    u64 readCapacity[2];
+} BatchWorker;
+
+// Must be freed after creation
+BatchWorker* BatchWorkersCreate(unsigned count) {
+    BatchWorker* workers = (BatchWorker*)calloc(count, sizeof(BatchWorker));
+    if (workers == NULL)
+        panic("Failed to allocate memory (batch workers)");
+
+    for (unsigned i = 0; i < count; i++) {
+        workers[i].cctx = ZSTD_createCCtx();
+        if (workers[i].cctx == NULL)
+            panic("Failed to create ZSTD compression context");
+
+        workers[i].dctx = ZSTD_createDCtx();
+        if (workers[i].dctx == NULL)
+            panic("Failed to create ZSTD decompression context");
+    }
+
+    return workers;
+}
+
+void BatchWorkersFree(BatchWorker* workers, unsigned count) {
+    for (unsigned i = 0; i < count; i++) {
+        ZSTD_freeCCtx(workers[i].cctx);
+        ZSTD_freeDCtx(workers[i].dctx);
+        free(workers[i].readBuf[0]);
+        free(workers[i].readBuf[1]);
+    }
+
+    free(workers);
+}
+
+typedef struct Batch {
+    ThreadPool* pool;
+
+    BatchWorker* workers;
+    unsigned workerCount;
+
+    const char* cacheDir; // Optional
+
+    ImageCompressParams compress;
+    ImageSelect select; // Extract
+
+    BatchJob* jobs;
+    u32 jobCount;
+    u32 jobCapacity;
+
+    pthread_mutex_t reportLock;
+    u32 doneCount;
+    u32 failedCount;
+
+    u64 savedBytes; // --optimize (atomic)
+
+    // Admission control (see BatchAdmit)
+    u64 memBudget; // 0 for no limit
+    ThreadPoolFunc jobFunc;
+
+    pthread_mutex_t admitLock;
+    BatchJob** admitOrder; // Heaviest first
+    u32 admitNext;
+    u64 memInUse;
+} Batch;
+
+void BatchInit(Batch* batch) {
+    memset(batch, 0, sizeof(Batch));
+    batch->compress = (ImageCompressParams)IMAGE_COMPRESS_PARAMS_DEFAULT;
+    batch->select = (ImageSelect)IMAGE_SELECT_ALL;
+    pthread_mutex_init(&batch->reportLock, NULL);
+    pthread_mutex_init(&batch->admitLock, NULL);
+}
+
+void BatchFree(Batch* batch) {
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        free(batch->jobs[i].inputPath);
+        free(batch->jobs[i].maskPath);
+        free(batch->jobs[i].outputPath);
+
+        PathListFree(&batch->jobs[i].outputs);
+    }
+    free(batch->jobs);
+
+    pthread_mutex_destroy(&batch->reportLock);
+    pthread_mutex_destroy(&batch->admitLock);
+}
+
+void BatchAddJob(Batch* batch, const char* inputPath, const char* maskPath, const char* outputPath) {
+    if (batch->jobCount == batch->jobCapacity) {
+        batch->jobCapacity = batch->jobCapacity ? batch->jobCapacity * 2 : 64;
+        batch->jobs = (BatchJob*)realloc(batch->jobs, batch->jobCapacity * sizeof(BatchJob));
+        if (batch->jobs == NULL)
+            panic("Failed to allocate memory (batch job list)");
+    }
+
+    BatchJob* job = &batch->jobs[batch->jobCount++];
+    memset(job, 0, sizeof(BatchJob));
+
+    job->batch = batch;
+
+    job->inputPath = strdup(inputPath);
+    job->maskPath = maskPath ? strdup(maskPath) : NULL;
+    job->outputPath = strdup(outputPath);
+    if (
+        job->inputPath == NULL || job->outputPath == NULL ||
+        (maskPath != NULL && job->maskPath == NULL)
+    )
+        panic("Failed to allocate memory (batch job paths)");
+}
+
+int BatchJobCompare(const void* a, const void* b) {
+    return strcmp(((BatchJob*)a)->inputPath, ((BatchJob*)b)->inputPath);
+}
+
+typedef struct {
+    Batch* batch;
+
+    const char* inputRoot;
+    u32 inputRootLength;
+    const char* outputRoot;
+} BatchCollectContext;
+
+void BatchCollectExtractFile(const char* path, void* userData) {
+    BatchCollectContext* ctx = (BatchCollectContext*)userData;
+
+    const char* dot = strrchr(path, '.');
+    if (dot == NULL || strcasecmp(dot, ".image") != 0)
+        return;
+
+    const char* relPath = path + ctx->inputRootLength;
+    while (*relPath == '/')
+        relPath++;
+
+    char outputPath[PATH_MAX];
+    snprintf(
+        outputPath, sizeof(outputPath), "%s/%.*s.png",
+        ctx->outputRoot,
+        (int)(dot - relPath), relPath
+    );
+
+    BatchAddJob(ctx->batch, path, NULL, outputPath);
+}
+
+// Queues every .image file below inputDir, mirroring the layout into outputDir.
+void BatchCollectExtract(Batch* batch, const char* inputDir, const char* outputDir) {
+    char inputRoot[PATH_MAX];
+    snprintf(inputRoot, sizeof(inputRoot), "%s", inputDir);
+
+    u32 rootLength = strlen(inputRoot);
+    while (rootLength > 1 && inputRoot[rootLength - 1] == '/')
+        inputRoot[--rootLength] = '\0';
+
+    BatchCollectContext ctx = {
+        .batch = batch,
+        .inputRoot = inputRoot,
+        .inputRootLength = rootLength,
+        .outputRoot = outputDir
+    };
+
+    walkDirectory(inputRoot, BatchCollectExtractFile, &ctx);
+
+    // Stable order regardless of readdir order
+    qsort(batch->jobs, batch->jobCount, sizeof(BatchJob), BatchJobCompare);
+}
+
+void BatchCollectOptimizeFile(const char* path, void* userData) {
+    const char* dot = strrchr(path, '.');
+    if (dot == NULL || strcasecmp(dot, ".image") != 0)
+        return;
+
+    BatchAddJob((Batch*)userData, path, NULL, path);
+}
+
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    u32 index;
+} BatchFileId;
+
+int BatchFileIdCompare(const void* a, const void* b) {
+    const BatchFileId* idA = (const BatchFileId*)a;
+    const BatchFileId* idB = (const BatchFileId*)b;
+
+    if (idA->device != idB->device)
+        return idA->device < idB->device ? -1 : 1;
+    if (idA->inode != idB->inode)
+        return idA->inode < idB->inode ? -1 : 1;
+
+    return (idA->index > idB->index) - (idA->index < idB->index);
+}
+
+// Queues each given .image file, and every .image file below each given
+// directory, to be recompressed in place. A file reached twice (listed
+// twice, under another spelling or through a link) is queued once.
+void BatchCollectOptimize(Batch* batch, char** paths, u32 pathCount) {
+    for (u32 i = 0; i < pathCount; i++) {
+        if (isDirectory(paths[i]))
+            walkDirectory(paths[i], BatchCollectOptimizeFile, batch);
+        else
+            BatchAddJob(batch, paths[i], NULL, paths[i]);
+    }
+
+    qsort(batch->jobs, batch->jobCount, sizeof(BatchJob), BatchJobCompare);
+
+    if (batch->jobCount == 0)
+        return;
+
+    // Two jobs must never rewrite the same file, so files are told apart by
+    // device and inode rather than by path
+    BatchFileId* ids = (BatchFileId*)malloc(batch->jobCount * sizeof(BatchFileId));
+    u8* duplicate = (u8*)calloc(batch->jobCount, 1);
+    if (ids == NULL || duplicate == NULL)
+        panic("Failed to allocate memory (batch file ids)");
+
+    u32 idCount = 0;
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        struct stat st;
+
+        // Files that can't be stat'ed fail on their own later
+        if (stat(batch->jobs[i].inputPath, &st) != 0)
+            continue;
+
+        ids[idCount++] = (BatchFileId){ .device = st.st_dev, .inode = st.st_ino, .index = i };
+    }
+
+    qsort(ids, idCount, sizeof(BatchFileId), BatchFileIdCompare);
+
+    // The first job (in path order) of each file is kept
+    for (u32 i = 1; i < idCount; i++) {
+        if (ids[i].device == ids[i - 1].device && ids[i].inode == ids[i - 1].inode)
+            duplicate[ids[i].index] = TRUE;
+    }
+
+    u32 kept = 0;
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        BatchJob* job = &batch->jobs[i];
+
+        if (duplicate[i]) {
+            free(job->inputPath);
+            free(job->outputPath);
+            continue;
+        }
+
+        batch->jobs[kept++] = *job;
+    }
+
+    batch->jobCount = kept;
+
+    free(ids);
+    free(duplicate);
+}
+
+// Manifest format: one job per line, "<input> <mask> <output>" separated by
+// spaces or tabs. Use "-" as the mask for no mask. Blank lines and lines
+// starting with '#' are ignored.
+void BatchCollectManifest(Batch* batch, const char* manifestPath) {
+    FILE* fp = fopen(manifestPath, "r");
+    if (fp == NULL)
+        panic("The manifest file could not be opened.");
+
+    char line[PATH_MAX * 3];
+    unsigned lineNo = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineNo++;
+
+        char* fields[3];
+        unsigned fieldCount = 0;
+
+        char* save;
+        for (char* tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (fieldCount == 0 && tok[0] == '#')
+                break;
+            if (fieldCount == 3) {
+                fieldCount++;
+                break;
+            }
+
+            fields[fieldCount++] = tok;
+        }
+
+        if (fieldCount == 0)
+            continue;
+
+        if (fieldCount != 3) {
+            printf("\nManifest line %u: expected '<input> <mask> <output>'.", lineNo);
+            fclose(fp);
+
+            panic("Malformed manifest.");
+        }
+
+        BatchAddJob(
+            batch,
+            fields[0],
+            strcmp(fields[1], "-") == 0 ? NULL : fields[1],
+            fields[2]
+        );
+    }
+
+    fclose(fp);
+}
+
+// Submits jobs in admitOrder for as long as their estimated peaks fit in the
+// memory budget together. A job that doesn't fit waits for running jobs to
+// release memory; one bigger than the whole budget runs once nothing else
+// does. Must be called with admitLock held.
+void BatchAdmitLocked(Batch* batch) {
+    while (batch->admitNext < batch->jobCount) {
+        BatchJob* job = batch->admitOrder[batch->admitNext];
+
+        if (
+            batch->memBudget != 0 && batch->memInUse != 0 &&
+            batch->memInUse + job->memPeak > batch->memBudget
+        )
+            break;
+
+        batch->memInUse += job->memPeak;
+        batch->admitNext++;
+
+        ThreadPoolSubmit(batch->pool, batch->jobFunc, job);
+    }
+}
+
+// Called once a job is done with its memory: admits whatever fits now.
+void BatchAdmitRelease(BatchJob* job) {
+    Batch* batch = job->batch;
+
+    pthread_mutex_lock(&batch->admitLock);
+
+    batch->memInUse -= job->memPeak;
+    BatchAdmitLocked(batch);
+
+    pthread_mutex_unlock(&batch->admitLock);
+}
+
+void BatchReport(BatchJob* job) {
+    Batch* batch = job->batch;
+
+    pthread_mutex_lock(&batch->reportLock);
+
+    batch->doneCount++;
+    if (job->failed)
+        batch->failedCount++;
+
+    if (job->failed)
+        printf("[%u/%u] %s .. FAILED (%s)\n", batch->doneCount, batch->jobCount, job->inputPath, job->error);
+    else if (job->cached)
+        printf("[%u/%u] %s .. OK (cached)\n", batch->doneCount, batch->jobCount, job->inputPath);
+    else if (job->note[0] != '\0')
+        printf("[%u/%u] %s .. OK (%s)\n", batch->doneCount, batch->jobCount, job->inputPath, job->note);
+    else
+        printf("[%u/%u] %s .. OK\n", batch->doneCount, batch->jobCount, job->inputPath);
+
+    pthread_mutex_unlock(&batch->reportLock);
+
+    BatchAdmitRelease(job);
+}
+
+// Level tasks of one job may fail concurrently; the first error is kept.
+void BatchJobFail(BatchJob* job) {
+    if (!__atomic_exchange_n(&job->failed, TRUE, __ATOMIC_ACQ_REL))
+        snprintf(job->error, sizeof(job->error), "%s", panicMessage);
+}
+
+int BatchJobHasFailed(BatchJob* job) {
+    return __atomic_load_n(&job->failed, __ATOMIC_ACQUIRE);
+}
+
+// Must be freed after creation (BatchSplitFree)
+BatchSplit* BatchSplitCreate(BatchJob* job, u32 taskCount, void (*finish)(BatchJob*, unsigned)) {
+    BatchSplit* split = (BatchSplit*)calloc(1, sizeof(BatchSplit));
+    if (split == NULL)
+        panic("Failed to allocate memory (batch split)");
+
+    split->tasks = (BatchLevelTask*)calloc(taskCount ? taskCount : 1, sizeof(BatchLevelTask));
+    split->paths = (char**)calloc(taskCount ? taskCount : 1, sizeof(char*));
+    if (split->tasks == NULL || split->paths == NULL) {
+        free(split->tasks);
+        free(split->paths);
+        free(split);
+
+        panic("Failed to allocate memory (batch split)");
+    }
+
+    split->taskCount = taskCount;
+    split->finish = finish;
+
+    // Held by the splitting job until it has submitted everything, so an
+    // early finisher can't free the split under it
+    split->pendingTasks = 1;
+
+    for (u32 i = 0; i < taskCount; i++) {
+        split->tasks[i].job = job;
+        split->tasks[i].index = i;
+    }
+
+    return split;
+}
+
+void BatchSplitFree(BatchSplit* split) {
+    for (u32 i = 0; i < split->taskCount; i++)
+        free(split->paths[i]);
+
+    free(split->paths);
+    free(split->tasks);
+    free(split);
+}
+
+// Drops one reference; the last one runs the finish function.
+void BatchSplitRelease(BatchJob* job, unsigned workerIndex) {
+    BatchSplit* split = job->split;
+
+    if (__atomic_sub_fetch(&split->pendingTasks, 1, __ATOMIC_ACQ_REL) == 0)
+        split->finish(job, workerIndex);
+}
+
+// Queues one task of the job's split on the calling worker's deque.
+void BatchSplitSubmitTask(BatchJob* job, ThreadPoolFunc taskFunc, u32 index) {
+    BatchSplit* split = job->split;
+
+    __atomic_add_fetch(&split->pendingTasks, 1, __ATOMIC_ACQ_REL);
+    ThreadPoolSubmit(job->batch->pool, taskFunc, &split->tasks[index]);
+}
+
+// Queues every task of the job's split, then drops the job's reference.
+void BatchSplitSubmit(BatchJob* job, ThreadPoolFunc taskFunc, unsigned workerIndex) {
+    for (u32 i = 0; i < job->split->taskCount; i++)
+        BatchSplitSubmitTask(job, taskFunc, i);
+
+    BatchSplitRelease(job, workerIndex);
+}
+
+void BatchExtractFinish(BatchJob* job, unsigned workerIndex) {
+    (void)workerIndex;
+
+    Batch* batch = job->batch;
+    BatchSplit* split = job->split;
+
+    jmp_buf recover;
+
+    logQuiet = TRUE;
+    panicRecover = &recover;
+
+    if (setjmp(recover) == 0) {
+        if (!BatchJobHasFailed(job)) {
+            // Levels in order, then the mask, same as a serial extraction
+            for (u32 i = 0; i < split->taskCount; i++) {
+                if (split->paths[i])
+                    PathListAdd(&job->outputs, split->paths[i]);
+            }
+
+            if (batch->cacheDir)
+                CacheStoreExtract(batch->cacheDir, split->cacheKey, job->outputPath, &job->outputs);
+        }
+    }
+    else
+        BatchJobFail(job);
+
+    panicRecover = NULL;
+
+    MappedFileClose(&job->input);
+
+    BatchSplitFree(split);
+    job->split = NULL;
+
+    BatchReport(job);
+}
+
+// Writes one level, or the mask for the last task (KTX_MAX_LEVELS).
+void BatchExtractLevelTask(void* arg, unsigned workerIndex) {
+    BatchLevelTask* task = (BatchLevelTask*)arg;
+    BatchJob* job = task->job;
+    BatchSplit* split = job->split;
+
+    jmp_buf recover;
+
+    logQuiet = TRUE;
+    panicRecover = &recover;
+
+    if (setjmp(recover) == 0) {
+        // No point writing more levels once one has failed
+        if (!BatchJobHasFailed(job)) {
+            char fn[PATH_MAX];
+            int written;
+
+            if (task->index < KTX_MAX_LEVELS)
+                written = ImageWriteLevel(&split->ktxHeader, task->index, task->data, task->size, job->outputPath, fn);
+            else
+                written = ImageExportMask(job->input.data, job->outputPath, fn);
+
+            if (written) {
+                split->paths[task->index] = strdup(fn);
+                if (split->paths[task->index] == NULL)
+                    panic("Failed to allocate memory (batch output path)");
+            }
+        }
+    }
+    else
+        BatchJobFail(job);
+
+    panicRecover = NULL;
+
+    free(task->data);
+    task->data = NULL;
+
+    BatchSplitRelease(job, workerIndex);
+}
+
+// KTXLevelCallback: hands a freshly decompressed level to a level task.
+void BatchExtractLevelReady(KTXHeader* ktxHeader, u32 mipIndex, u8* levelData, u32 levelSize, void* userData) {
+    BatchJob* job = (BatchJob*)userData;
+    BatchSplit* split = job->split;
+
+    // The first level streamed comes before any level task can read this
+    if (!split->haveKTXHeader) {
+        split->ktxHeader = *ktxHeader;
+        split->haveKTXHeader = TRUE;
+    }
+
+    split->tasks[mipIndex].data = levelData;
+    split->tasks[mipIndex].size = levelSize;
+
+    BatchSplitSubmitTask(job, BatchExtractLevelTask, mipIndex);
+}
+
+// Maps the file and streams its KTX data, submitting a task for each level as
+// soon as it has been decompressed (and one for the mask up front), so
+// encoding overlaps decompression.
+void BatchExtractJob(void* arg, unsigned workerIndex) {
+    BatchJob* job = (BatchJob*)arg;
+    Batch* batch = job->batch;
+    BatchWorker* worker = &batch->workers[workerIndex];
+
+    jmp_buf recover;
+
+    logQuiet = TRUE;
+    panicRecover = &recover;
+
+    if (setjmp(recover) == 0) {
+        // Mapped rather than copied; zstd reads the payload straight from the page cache
+        MappedFileOpen(&job->input, job->inputPath);
+        ImageCheckSize(job->input.data, job->input.size);
+
+        makeParentDirectories(job->outputPath);
+
+        u64 cacheKey = 0;
+        if (batch->cacheDir) {
+            char options[128];
+            CacheExtractOptions(options, sizeof(options), job->outputPath, &batch->select);
+
+            cacheKey = CacheKeyCreate(options, job->input.data, job->input.size, NULL, 0);
+            job->cached = CacheFetchExtract(batch->cacheDir, cacheKey, job->outputPath, &job->outputs);
+        }
+
+        if (!job->cached) {
+            ImageCheckHeader(job->input.data);
+
+            // Lowercases the extension now, before the level tasks share the path
+            getFileExtension(job->outputPath);
+
+            // Levels by mip index, then the mask
+            job->split = BatchSplitCreate(job, KTX_MAX_LEVELS + 1, BatchExtractFinish);
+            job->split->cacheKey = cacheKey;
+
+            // The mask doesn't depend on the KTX data
+            if (batch->select.mask && ImageGetMaskExists(job->input.data))
+                BatchSplitSubmitTask(job, BatchExtractLevelTask, KTX_MAX_LEVELS);
+
+            ImageStreamKTX(job->input.data, worker->dctx, &batch->select, BatchExtractLevelReady, job);
+        }
+    }
+    else
+        BatchJobFail(job);
+
+    panicRecover = NULL;
+
+    // Levels already submitted still run; the last one to finish reports
+    if (job->split) {
+        BatchSplitRelease(job, workerIndex);
+        return;
+    }
+
+    MappedFileClose(&job->input);
+
+    BatchReport(job);
+}
+
+// Recompresses both payloads of a .image file as they are (no mip
+// regeneration) with batch->compress. The file is only replaced if the
+// result is smaller.
+void BatchOptimizeJob(void* arg, unsigned workerIndex) {
+    BatchJob* job = (BatchJob*)arg;
+    Batch* batch = job->batch;
+    BatchWorker* worker = &batch->workers[workerIndex];
+
+    u8* volatile ktxData = NULL;
+    u8* volatile maskData = NULL;
+    ImageWriter* volatile writer = NULL;
+
+    jmp_buf recover;
+
+    logQuiet = TRUE;
+    panicRecover = &recover;
+
+    if (setjmp(recover) == 0) {
+        MappedFileOpen(&job->input, job->inputPath);
+        ImageCheckSize(job->input.data, job->input.size);
+        ImageCheckHeader(job->input.data);
+
+        ImageFileHeader* fileHeader = (ImageFileHeader*)job->input.data;
+
+        if (
+            fileHeader->maskDecompressedDataSize !=
+                (u32)fileHeader->maskWidth * fileHeader->maskHeight
+        )
+            panic("Unexpected mask data size");
+
+        ktxData = ImageDecompressPayload(
+            worker->dctx,
+            fileHeader->headerEnd, fileHeader->compressedDataSize,
+            fileHeader->decompressedDataSize
+        );
+
+        if (fileHeader->maskDecompressedDataSize != 0) {
+            maskData = ImageDecompressPayload(
+                worker->dctx,
+                fileHeader->headerEnd + fileHeader->compressedDataSize, fileHeader->maskCompressedDataSize,
+                fileHeader->maskDecompressedDataSize
+            );
+        }
+
+        char tempPath[PATH_MAX];
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp.%d", job->outputPath, (int)getpid());
+
+        writer = ImageWriterCreate(
+            tempPath, worker->cctx, &batch->compress,
+            fileHeader->width, fileHeader->height,
+            fileHeader->decompressedDataSize
+        );
+
+        ImageWriterSetMask(writer, maskData, fileHeader->maskWidth, fileHeader->maskHeight);
+
+        if (batch->compress.autoBudgetMs != 0)
+            ImageWriterWriteKTXAuto(writer, ktxData, fileHeader->decompressedDataSize);
+        else
+            ImageWriterWriteKTX(writer, ktxData, fileHeader->decompressedDataSize);
+
+        u64 newSize = ImageWriterFinish(writer);
+
+        char autoNote[96] = "";
+        if (batch->compress.autoBudgetMs != 0) {
+            autoNote[0] = ',';
+            autoNote[1] = ' ';
+            ImageWriterDescribeAuto(writer, autoNote + 2, sizeof(autoNote) - 2);
+        }
+
+        if (newSize < job->input.size) {
+            struct stat st;
+            if (stat(job->outputPath, &st) == 0)
+                chmod(tempPath, st.st_mode & 07777);
+
+            if (rename(tempPath, job->outputPath) != 0) {
+                unlink(tempPath);
+                panic("The optimized image binary could not replace the original.");
+            }
+
+            __atomic_add_fetch(&batch->savedBytes, job->input.size - newSize, __ATOMIC_RELAXED);
+
+            snprintf(job->note, sizeof(job->note), "saved %lu bytes%s", job->input.size - newSize, autoNote);
+        }
+        else {
+            unlink(tempPath);
+
+            snprintf(job->note, sizeof(job->note), "kept, no smaller%s", autoNote);
+        }
+    }
+    else
+        BatchJobFail(job);
+
+    panicRecover = NULL;
+
+    // Also removes a partial output
+    if (writer)
+        ImageWriterFree(writer);
+
+    free(ktxData);
+    free(maskData);
+
+    MappedFileClose(&job->input);
+
+    BatchReport(job);
+}
+
+// Reads a whole file into one of the worker's reusable buffers.
+u8* BatchWorkerRead(BatchWorker* worker, unsigned slot, const char* path, u64* sizeOut) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        panic("The input image file could not be opened.");
+
+    fseek(fp, 0, SEEK_END);
+    u64 size = ftell(fp);
+    rewind(fp);
+
+    if (size > worker->readCapacity[slot]) {
+        free(worker->readBuf[slot]);
+
+        worker->readBuf[slot] = (u8*)malloc(size);
+        worker->readCapacity[slot] = worker->readBuf[slot] ? size : 0;
+
+        if (worker->readBuf[slot] == NULL) {
+            fclose(fp);
+            panic("Failed to allocate memory (batch read buffer)");
+        }
+    }
+
+    u64 bytesCopied = fread(worker->readBuf[slot], 1, size, fp);
+    fclose(fp);
+
+    if (bytesCopied != size)
+        panic("The input image file could not be read.");
+
+    *sizeOut = size;
+    return worker->readBuf[slot];
+}
+
+void BatchCreateFinish(BatchJob* job, unsigned workerIndex) {
+    Batch* batch = job->batch;
+    BatchWorker* worker = &batch->workers[workerIndex];
+    BatchSplit* split = job->split;
+
+    ImageWriter* volatile writer = NULL;
+
+    jmp_buf recover;
+
+    logQuiet = TRUE;
+    panicRecover = &recover;
+
+    if (setjmp(recover) == 0) {
+        if (!BatchJobHasFailed(job)) {
+            KTXHeader* ktxHeader = (KTXHeader*)split->ktx.data;
+
+            writer = ImageWriterCreate(
+                job->outputPath, worker->cctx, &batch->compress,
+                ktxHeader->pixelWidth, ktxHeader->pixelHeight,
+                split->ktx.size
+            );
+
+            ImageWriterSetMask(writer, split->maskData, (u16)split->maskWidth, (u16)split->maskHeight);
+
+            if (batch->compress.autoBudgetMs != 0) {
+                ImageWriterWriteKTXAuto(writer, split->ktx.data, split->ktx.size);
+                ImageWriterDescribeAuto(writer, job->note, sizeof(job->note));
+            }
+            else
+                ImageWriterWriteKTX(writer, split->ktx.data, split->ktx.size);
+
+            ImageWriterFinish(writer);
+
+            if (batch->cacheDir)
+                CacheStoreImage(batch->cacheDir, split->cacheKey, job->outputPath);
+
+            PathListAdd(&job->outputs, job->outputPath);
+        }
+    }
+    else
+        BatchJobFail(job);
+
+    panicRecover = NULL;
+
+    // Also removes a partial output
+    if (writer)
+        ImageWriterFree(writer);
+
+    free(split->ktx.data);
+
+    if (split->maskData)
+        stbi_image_free(split->maskData);
+
+    if (split->chain)
+        MipChainDestroy(split->chain);
+
+    BatchSplitFree(split);
+    job->split = NULL;
+
+    BatchReport(job);
+}
+
+// Every level of the job's chain is built; drops the chain's reference.
+void BatchCreateChainDone(void* userData, unsigned workerIndex) {
+    BatchSplitRelease((BatchJob*)userData, workerIndex);
+}
+
+// Reads and decodes the sources, then starts the job's mip chain on the
+// batch pool. Compression runs once every level is done.
+void BatchCreateJob(void* arg, unsigned workerIndex) {
+    BatchJob* job = (BatchJob*)arg;
+    Batch* batch = job->batch;
+    BatchWorker* worker = &batch->workers[workerIndex];
+
+    u8* volatile inputData = NULL;
+    u8* volatile maskData = NULL;
+    u8* volatile ktxData = NULL;
+
+    jmp_buf recover;
+
+    logQuiet = TRUE;
+    panicRecover = &recover;
+
+    if (setjmp(recover) == 0) {
+        u64 inputFileSize;
+        u8* inputFile = BatchWorkerRead(worker, 0, job->inputPath, &inputFileSize);
+
+        u64 maskFileSize = 0;
+        u8* maskFile = NULL;
+        if (job->maskPath)
+            maskFile = BatchWorkerRead(worker, 1, job->maskPath, &maskFileSize);
+
+        makeParentDirectories(job->outputPath);
+
+        u64 cacheKey = 0;
+        if (batch->cacheDir) {
+            char options[128];
+            CacheCreateOptions(options, sizeof(options), &batch->compress);
+
+            cacheKey = CacheKeyCreate(options, inputFile, inputFileSize, maskFile, maskFileSize);
+            job->cached = CacheFetchImage(batch->cacheDir, cacheKey, job->outputPath);
+        }
+
+        if (job->cached)
+            PathListAdd(&job->outputs, job->outputPath);
+        else {
+            int imageWidth, imageHeight;
+            inputData = stbi_load_from_memory(inputFile, inputFileSize, &imageWidth, &imageHeight, NULL, 4);
+            if (inputData == NULL)
+                panic("The input image file could not be decoded.");
+
+            int maskWidth = 0, maskHeight = 0;
+
+            if (maskFile) {
+                maskData = stbi_load_from_memory(maskFile, maskFileSize, &maskWidth, &maskHeight, NULL, 1);
+                if (maskData == NULL)
+                    panic("The input mask image could not be decoded.");
+            }
+
+            KTXView ktx;
+            KTXAllocate(inputData, imageWidth, imageHeight, &ktx);
+            ktxData = ktx.data;
+
+            // Levelzero is a copy, and the other levels are built from it
+            stbi_image_free(inputData);
+            inputData = NULL;
+
+            BatchSplit* split = BatchSplitCreate(job, 0, BatchCreateFinish);
+
+            split->cacheKey = cacheKey;
+            split->maskData = maskData;
+            split->maskWidth = maskWidth;
+            split->maskHeight = maskHeight;
+            split->ktx = ktx;
+
+            // The split owns these now, and BatchCreateFinish frees them
+            job->split = split;
+
+            u8* levels[KTX_MAX_LEVELS];
+            KTXGetLevelPointers(&ktx, levels);
+
+            split->chain = MipChainCreate(levels, ktx.levelCount, imageWidth, imageHeight);
+        }
+    }
+    else
+        BatchJobFail(job);
+
+    panicRecover = NULL;
+
+    if (job->split) {
+        BatchSplit* split = job->split;
+
+        // A failed job goes straight to BatchCreateFinish to clean up
+        if (split->chain) {
+            __atomic_add_fetch(&split->pendingTasks, 1, __ATOMIC_ACQ_REL);
+            MipChainStart(split->chain, batch->pool, BatchCreateChainDone, job, workerIndex);
+        }
+
+        BatchSplitRelease(job, workerIndex);
+        return;
+    }
+
+    free(ktxData);
+
+    if (inputData)
+        stbi_image_free(inputData);
+    if (maskData)
+        stbi_image_free(maskData);
+
+    BatchReport(job);
+}
+
+// Extract cost grows with the payload sizes, which the header gives us
+// without decompressing anything.
+// KTX data is streamed, so peak memory is the selected levels (each held
+// until it has been written; any of them may be waiting at once), the PNG
+// encoder's buffers for the largest of them (about twice its pixel data),
+// the zstd window and the mapped file, plus the mask and its encoder.
+void BatchWeighExtract(Batch* batch) {
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        BatchJob* job = &batch->jobs[i];
+
+        ImageFileHeader header;
+        u64 window;
+
+        if (!ImageReadStreamWindow(job->inputPath, &header, &window)) {
+            job->weight = 0;
+            job->memPeak = 0;
+            continue;
+        }
+
+        job->weight =
+            (u64)header.compressedDataSize + header.decompressedDataSize +
+            header.maskCompressedDataSize + header.maskDecompressedDataSize;
+
+        // Level sizes as KTXCreate lays them out
+        KTXHeader ktxHeader;
+        KTXInitHeader(&ktxHeader, header.width, header.height);
+
+        u32 wanted = ImageSelectLevels(&batch->select, &ktxHeader);
+
+        u64 selectedSize = 0;
+        u64 largestSize = 0;
+
+        for (u32 j = 0; j < KTXGetCreateMipCount(header.width, header.height); j++) {
+            if (!(wanted & (1u << j)))
+                continue;
+
+            u64 levelSize = KTXGetCreateLevelSize(header.width, header.height, j);
+
+            selectedSize += levelSize;
+            if (levelSize > largestSize)
+                largestSize = levelSize;
+        }
+
+        job->memPeak =
+            sizeof(ImageFileHeader) +
+            header.compressedDataSize + header.maskCompressedDataSize +
+            selectedSize + largestSize * 2 +
+            window + ZSTD_BLOCKSIZE_MAX;
+
+        if (batch->select.mask)
+            job->memPeak += (u64)header.maskDecompressedDataSize * 3;
+    }
+}
+
+// Same weight as an extract. Peak memory is the whole file and both payloads
+// decompressed, plus two compress buffers per candidate try with --auto.
+void BatchWeighOptimize(Batch* batch) {
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        BatchJob* job = &batch->jobs[i];
+
+        ImageFileHeader header;
+        if (ImageReadHeader(job->inputPath, &header)) {
+            job->weight =
+                (u64)header.compressedDataSize + header.decompressedDataSize +
+                header.maskCompressedDataSize + header.maskDecompressedDataSize;
+
+            job->memPeak =
+                sizeof(ImageFileHeader) +
+                header.compressedDataSize + header.maskCompressedDataSize +
+                header.decompressedDataSize + header.maskDecompressedDataSize;
+
+            if (batch->compress.autoBudgetMs != 0)
+                job->memPeak += (u64)header.decompressedDataSize * 2;
+        }
+        else {
+            job->weight = 0;
+            job->memPeak = 0;
+        }
+    }
+}
+
+u64 BatchImagePixelCount(const char* path) {
+    int width, height;
+    if (!stbi_info(path, &width, &height, NULL))
+        return 0;
+
+    return (u64)width * height;
+}
+
+u64 BatchFileSize(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+
+    return st.st_size;
+}
+
+// Create cost grows with the source dimensions (read from the image header
+// only). The KTX with its mip chain is about 4/3 of the RGBA level zero.
+// Peak memory is the source files, the decoded image and the KTX data. The
+// output is compressed straight into the file, so only the mask source files
+// and decoded mask add to that.
+void BatchWeighCreate(Batch* batch) {
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        BatchJob* job = &batch->jobs[i];
+
+        u64 pixelCount = BatchImagePixelCount(job->inputPath);
+        u64 ktxSize = pixelCount * 4 * 4 / 3;
+
+        job->weight = ktxSize;
+        job->memPeak = BatchFileSize(job->inputPath) + pixelCount * 4 + ktxSize;
+
+        if (job->maskPath) {
+            u64 maskPixelCount = BatchImagePixelCount(job->maskPath);
+
+            job->weight += maskPixelCount;
+            job->memPeak += BatchFileSize(job->maskPath) + maskPixelCount;
+        }
+    }
+}
+
+int BatchJobCompareWeight(const void* a, const void* b) {
+    const BatchJob* jobA = *(const BatchJob**)a;
+    const BatchJob* jobB = *(const BatchJob**)b;
+
+    if (jobA->weight != jobB->weight)
+        return jobA->weight < jobB->weight ? 1 : -1;
+
+    // Keep the order stable on ties
+    return (jobA > jobB) - (jobA < jobB);
+}
+
+// Keeps only the jobs belonging to shard shardIndex of shardCount. Jobs are
+// dealt out heaviest first, each to the currently lightest shard, so shards
+// finish at about the same time. The job list and weights must be the same in
+// every process for the shards to add up to the whole batch.
+void BatchSelectShard(Batch* batch, u32 shardIndex, u32 shardCount) {
+    if (shardCount <= 1 || batch->jobCount == 0)
+        return;
+
+    BatchJob** order = (BatchJob**)malloc(batch->jobCount * sizeof(BatchJob*));
+    u64* shardLoad = (u64*)calloc(shardCount, sizeof(u64));
+    u8* keep = (u8*)calloc(batch->jobCount, 1);
+    if (order == NULL || shardLoad == NULL || keep == NULL)
+        panic("Failed to allocate memory (batch sharding)");
+
+    for (u32 i = 0; i < batch->jobCount; i++)
+        order[i] = &batch->jobs[i];
+
+    qsort(order, batch->jobCount, sizeof(BatchJob*), BatchJobCompareWeight);
+
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        u32 lightest = 0;
+        for (u32 j = 1; j < shardCount; j++) {
+            if (shardLoad[j] < shardLoad[lightest])
+                lightest = j;
+        }
+
+        // +1 so zero-weight jobs are still spread out
+        shardLoad[lightest] += order[i]->weight + 1;
+
+        if (lightest == shardIndex)
+            keep[order[i] - batch->jobs] = TRUE;
+    }
+
+    u32 keptCount = 0;
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        BatchJob* job = &batch->jobs[i];
+
+        if (keep[i])
+            batch->jobs[keptCount++] = *job;
+        else {
+            free(job->inputPath);
+            free(job->maskPath);
+            free(job->outputPath);
+        }
+    }
+
+    batch->jobCount = keptCount;
+
+    free(order);
+    free(shardLoad);
+    free(keep);
+}
+
+// One rule per successful job. extraInput (e.g. the manifest) is optional
+// and becomes a dependency of every output.
+void BatchWriteDepfile(Batch* batch, const char* depfilePath, const char* extraInput) {
+    FILE* fp = DepfileOpen(depfilePath);
+
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        BatchJob* job = &batch->jobs[i];
+        if (job->failed)
+            continue;
+
+        const char* inputs[3] = { job->inputPath, job->maskPath, extraInput };
+        DepfileWriteRule(fp, &job->outputs, inputs, 3);
+    }
+
+    DepfileClose(fp);
+}
+
+// Number of jobs that can only run alone under the memory budget
+u32 BatchCountOverBudget(Batch* batch) {
+    u32 count = 0;
+
+    for (u32 i = 0; i < batch->jobCount; i++) {
+        if (batch->memBudget != 0 && batch->jobs[i].memPeak > batch->memBudget)
+            count++;
+    }
+
+    return count;
+}
+
+// Runs every job on a work-stealing pool of threadCount workers, heaviest
+// first so a big file doesn't start last and hold up the end of the batch.
+// Jobs must have been weighed (BatchWeigh*). Returns the failed job count.
+u32 BatchRun(Batch* batch, ThreadPoolFunc jobFunc, unsigned threadCount) {
+    if (threadCount == 0)
+        threadCount = 1;
+
+    batch->workerCount = threadCount;
+    batch->workers = BatchWorkersCreate(threadCount);
+
+    batch->admitOrder = (BatchJob**)malloc((batch->jobCount ? batch->jobCount : 1) * sizeof(BatchJob*));
+    if (batch->admitOrder == NULL)
+        panic("Failed to allocate memory (batch admission order)");
+
+    for (u32 i = 0; i < batch->jobCount; i++)
+        batch->admitOrder[i] = &batch->jobs[i];
+
+    qsort(batch->admitOrder, batch->jobCount, sizeof(BatchJob*), BatchJobCompareWeight);
+
+    batch->jobFunc = jobFunc;
+    batch->admitNext = 0;
+    batch->memInUse = 0;
+
+    batch->pool = ThreadPoolCreate(threadCount);
+
+    pthread_mutex_lock(&batch->admitLock);
+    BatchAdmitLocked(batch);
+    pthread_mutex_unlock(&batch->admitLock);
+
+    // Finished jobs admit the rest; this also waits for the level tasks the
+    // jobs split into
+    ThreadPoolWait(batch->pool);
+    ThreadPoolDestroy(batch->pool);
+    batch->pool = NULL;
+
+    free(batch->admitOrder);
+    batch->admitOrder = NULL;
+
+    BatchWorkersFree(batch->workers, threadCount);
+    batch->workers = NULL;
+
+    return batch->failedCount;
+}
+
+#endif
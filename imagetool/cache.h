@@ -0,0 +1,274 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/sendfile.h>
+
+#include "common.h"
+#include "hash.h"
+#include "imageProcess.h"
+
+// Content-addressed output cache. Entries are named by a 64-bit hash of the
+// tool version, the options that affect the output and the input bytes:
+//     <cache>/<key>.image   created .image file
+//     <cache>/<key>.x/      extracted files, named by their suffix ("mip1.png", "mask.png")
+// Outputs are copied in and out rather than hard-linked so later writes to
+// an output can't corrupt the cache.
+
+u32 cacheTempCounter = 0;
+
+u64 CacheKeyCreate(const char* options, u8* inputData, u64 inputSize, u8* maskData, u64 maskSize) {
+    Hash64 hash;
+    Hash64Init(&hash, 0);
+
+    const char* version = "imagetool " IMAGETOOL_VERSION;
+    Hash64Update(&hash, version, strlen(version) + 1);
+    Hash64Update(&hash, options, strlen(options) + 1);
+
+    Hash64Update(&hash, &inputSize, sizeof(inputSize));
+    Hash64Update(&hash, inputData, inputSize);
+
+    Hash64Update(&hash, &maskSize, sizeof(maskSize));
+    if (maskData != NULL)
+        Hash64Update(&hash, maskData, maskSize);
+
+    return Hash64Digest(&hash);
+}
+
+// Describes every option that changes the output of a create.
+void CacheCreateOptions(char* dst, u32 size, const ImageCompressParams* compress) {
+    char description[64];
+    ImageCompressParamsDescribe(compress, description, sizeof(description));
+
+    // Mip levels used to be scaled from levelzero; entries made that way
+    // don't match the box filtered levels
+    int length = snprintf(dst, size, "create %s mip=box", description);
+
+    // Output doesn't depend on the worker count, only on whether workers are used
+    if (compress->workers > 0 && length >= 0 && (u32)length < size)
+        length += snprintf(dst + length, size - length, " mt job=%u", compress->jobSize);
+
+    if (compress->autoBudgetMs != 0 && length >= 0 && (u32)length < size)
+        snprintf(dst + length, size - length, " auto=%u", compress->autoBudgetMs);
+}
+
+// Describes every option that changes the output of an extract.
+void CacheExtractOptions(char* dst, u32 size, const char* outputPath, const ImageSelect* select) {
+    const char* filename = getFilename((char*)outputPath);
+    const char* dot = strrchr(filename, '.');
+
+    snprintf(dst, size, "extract ext=%s", (dot && dot != filename) ? dot + 1 : "");
+    for (char* c = dst; *c; c++)
+        *c = tolower(*c);
+
+    // Unchanged for a full extraction, so existing entries stay valid
+    if (!ImageSelectIsAll(select)) {
+        u32 length = strlen(dst);
+        snprintf(
+            dst + length, size - length, " levels=%x last=%d mask=%d",
+            select->levels, select->last, select->mask
+        );
+    }
+}
+
+// Returns FALSE on failure, doesn't panic: the cache is only an optimization.
+int CacheCopyFile(const char* srcPath, const char* dstPath) {
+    int src = open(srcPath, O_RDONLY | O_CLOEXEC);
+    if (src < 0)
+        return FALSE;
+
+    struct stat st;
+    if (fstat(src, &st) != 0) {
+        close(src);
+        return FALSE;
+    }
+
+    int dst = open(dstPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst < 0) {
+        close(src);
+        return FALSE;
+    }
+
+    u64 remaining = st.st_size;
+    int ok = TRUE;
+
+    while (remaining > 0) {
+        ssize_t copied = sendfile(dst, src, NULL, remaining);
+        if (copied < 0 && errno == EINTR)
+            continue;
+
+        if (copied <= 0) {
+            ok = FALSE;
+            break;
+        }
+
+        remaining -= copied;
+    }
+
+    close(src);
+    if (close(dst) != 0)
+        ok = FALSE;
+
+    return ok;
+}
+
+void CacheTempPath(char* dst, const char* cacheDir, u64 key, const char* suffix) {
+    u32 counter = __atomic_fetch_add(&cacheTempCounter, 1, __ATOMIC_RELAXED);
+
+    snprintf(
+        dst, PATH_MAX, "%s/%016lx%s.tmp.%d.%u",
+        cacheDir, key, suffix, (int)getpid(), counter
+    );
+}
+
+// Creates the cache directory if needed.
+void CacheInit(const char* cacheDir) {
+    char probe[PATH_MAX];
+    snprintf(probe, sizeof(probe), "%s/.", cacheDir);
+
+    makeParentDirectories(probe);
+}
+
+int CacheFetchImage(const char* cacheDir, u64 key, const char* outputPath) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016lx.image", cacheDir, key);
+
+    if (access(path, R_OK) != 0)
+        return FALSE;
+
+    return CacheCopyFile(path, outputPath);
+}
+
+// Copies the .image already written at imagePath into the cache.
+void CacheStoreImage(const char* cacheDir, u64 key, const char* imagePath) {
+    char path[PATH_MAX];
+    char tempPath[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%016lx.image", cacheDir, key);
+    CacheTempPath(tempPath, cacheDir, key, ".image");
+
+    // Written under a temporary name and renamed so readers never see a partial entry
+    if (!CacheCopyFile(imagePath, tempPath) || rename(tempPath, path) != 0) {
+        unlink(tempPath);
+        warn("The cache entry could not be written.");
+    }
+}
+
+// Length of outputPath without its extension
+u32 CacheOutputStemLength(const char* outputPath) {
+    const char* filename = strrchr(outputPath, '/');
+    filename = filename ? filename + 1 : outputPath;
+
+    const char* dot = strrchr(filename, '.');
+    if (dot == NULL || dot == filename)
+        return strlen(outputPath);
+
+    return dot - outputPath;
+}
+
+// Copies a cached extraction next to outputPath. Copied paths are added to
+// writtenOut, but only if every copy succeeded.
+int CacheFetchExtract(const char* cacheDir, u64 key, const char* outputPath, PathList* writtenOut) {
+    char dirPath[PATH_MAX];
+    snprintf(dirPath, sizeof(dirPath), "%s/%016lx.x", cacheDir, key);
+
+    // Sorted so the copied paths come out in a stable order
+    struct dirent** entries;
+    int entryCount = scandir(dirPath, &entries, NULL, alphasort);
+    if (entryCount < 0)
+        return FALSE;
+
+    u32 stemLength = CacheOutputStemLength(outputPath);
+    int ok = TRUE;
+
+    u32 writtenCount = writtenOut ? writtenOut->count : 0;
+
+    for (int i = 0; i < entryCount; i++) {
+        const char* name = entries[i]->d_name;
+        if (!ok || name[0] == '.')
+            continue;
+
+        char srcPath[PATH_MAX];
+        char dstPath[PATH_MAX];
+
+        if (
+            snprintf(srcPath, sizeof(srcPath), "%s/%s", dirPath, name) >= PATH_MAX ||
+            snprintf(dstPath, sizeof(dstPath), "%.*s.%s", (int)stemLength, outputPath, name) >= PATH_MAX ||
+            !CacheCopyFile(srcPath, dstPath)
+        )
+            ok = FALSE;
+        else if (writtenOut != NULL)
+            PathListAdd(writtenOut, dstPath);
+    }
+
+    for (int i = 0; i < entryCount; i++)
+        free(entries[i]);
+    free(entries);
+
+    // The fallback extraction lists the files again
+    if (!ok && writtenOut != NULL)
+        PathListTruncate(writtenOut, writtenCount);
+
+    return ok;
+}
+
+void CacheRemoveDirectory(const char* dirPath) {
+    DIR* dir = opendir(dirPath);
+    if (dir == NULL)
+        return;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+        unlink(path);
+    }
+
+    closedir(dir);
+    rmdir(dirPath);
+}
+
+// Stores the files an extraction wrote (as listed in written) under the key.
+void CacheStoreExtract(const char* cacheDir, u64 key, const char* outputPath, PathList* written) {
+    char dirPath[PATH_MAX];
+    char tempPath[PATH_MAX];
+
+    snprintf(dirPath, sizeof(dirPath), "%s/%016lx.x", cacheDir, key);
+    CacheTempPath(tempPath, cacheDir, key, ".x");
+
+    if (mkdir(tempPath, 0755) != 0) {
+        warn("The cache entry could not be written.");
+        return;
+    }
+
+    u32 stemLength = CacheOutputStemLength(outputPath);
+
+    for (u32 i = 0; i < written->count; i++) {
+        const char* path = written->paths[i];
+
+        // Everything after "<stem>." is the entry name
+        if (strncmp(path, outputPath, stemLength) != 0 || path[stemLength] != '.')
+            continue;
+
+        char dstPath[PATH_MAX];
+        if (
+            snprintf(dstPath, sizeof(dstPath), "%s/%s", tempPath, path + stemLength + 1) >= PATH_MAX ||
+            !CacheCopyFile(path, dstPath)
+        ) {
+            CacheRemoveDirectory(tempPath);
+            warn("The cache entry could not be written.");
+            return;
+        }
+    }
+
+    // Another worker may have stored the same entry first; either copy is fine
+    if (rename(tempPath, dirPath) != 0)
+        CacheRemoveDirectory(tempPath);
+}
+
+#endif
@@ -8,6 +8,17 @@
 
 #include <string.h>
 
+#include <limits.h>
+#include <setjmp.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
 typedef unsigned long u64;
 typedef unsigned int u32;
 typedef unsigned short u16;
@@ -22,9 +33,27 @@ typedef signed char s8;
 
 #define INDENT_SPACE "    "
 
-#define LOG_OK printf(" OK\n")
+#define IMAGETOOL_VERSION "1.1"
+
+// Progress logging can be silenced per thread (batch workers run quiet
+// so their output doesn't interleave).
+__thread int logQuiet = FALSE;
+
+#define logMsg(...) do { if (!logQuiet) printf(__VA_ARGS__); } while (0)
+
+#define LOG_OK logMsg(" OK\n")
+
+// If set, panic unwinds to this point instead of exiting the process.
+// Used by batch jobs so a bad file is reported and skipped.
+__thread jmp_buf* panicRecover = NULL;
+__thread char panicMessage[256];
 
 void panic(const char* msg) {
+    if (panicRecover != NULL) {
+        snprintf(panicMessage, sizeof(panicMessage), "%s", msg);
+        longjmp(*panicRecover, 1);
+    }
+
     printf("\nPANIC: %s\nExiting ..\n", msg);
     exit(1);
 }
@@ -59,11 +88,274 @@ char* getFileExtension(char* filename) {
     if (!dot || dot == filename)
         return "";
 
+    // Only writes when something changes, so an already lowercase path
+    // can be shared between threads
     char* extension = dot + 1;
-    for (char* c = extension; *c; c++)
-        *c = tolower(*c);
+    for (char* c = extension; *c; c++) {
+        if (isupper(*c))
+            *c = tolower(*c);
+    }
 
     return extension;
 }
 
+// Monotonic clock in milliseconds
+double getTimeMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+unsigned getCPUCount(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (unsigned)count : 1;
+}
+
+int isDirectory(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Creates every missing parent directory of a file path.
+void makeParentDirectories(const char* path) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    for (char* c = buf + 1; *c; c++) {
+        if (*c != '/')
+            continue;
+
+        *c = '\0';
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST)
+            panic("The output directory could not be created.");
+        *c = '/';
+    }
+}
+
+// Must be freed after creation
+u8* readFileBinary(const char* path, u64* sizeOut) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        panic("The input image binary could not be opened.");
+
+    fseek(fp, 0, SEEK_END);
+    u64 size = ftell(fp);
+    rewind(fp);
+
+    if (size == 0) {
+        fclose(fp);
+
+        panic("The image binary is empty.");
+    }
+
+    u8* buf = (u8 *)malloc(size);
+    if (buf == NULL) {
+        fclose(fp);
+
+        panic("Failed to allocate memory (image binary buffer)");
+    }
+
+    u64 bytesCopied = fread(buf, 1, size, fp);
+    if (bytesCopied != size) {
+        free(buf);
+        fclose(fp);
+
+        panic("The input image binary could not be read.");
+    }
+
+    fclose(fp);
+
+    if (sizeOut != NULL)
+        *sizeOut = size;
+
+    return buf;
+}
+
+// Input bytes, either mapped from a descriptor or read into memory (pipes)
+typedef struct {
+    u8* data;
+    u64 size;
+    int mapped;
+} MappedFile;
+
+// Maps fd read-only, or reads it until EOF if it can't be mapped. Returns
+// NULL on success, otherwise what went wrong; doesn't panic.
+const char* MappedFileLoad(MappedFile* file, int fd) {
+    memset(file, 0, sizeof(MappedFile));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return "The input could not be inspected.";
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            // Inputs are hashed and decompressed front to back
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+            file->data = (u8*)map;
+            file->size = st.st_size;
+            file->mapped = TRUE;
+
+            return NULL;
+        }
+    }
+
+    // Not mappable (pipe, socket ..), read until EOF
+    u64 capacity = 1 << 16;
+    file->data = (u8*)malloc(capacity);
+    if (file->data == NULL)
+        return "Failed to allocate memory (input buffer)";
+
+    while (TRUE) {
+        if (file->size == capacity) {
+            capacity *= 2;
+
+            u8* newData = (u8*)realloc(file->data, capacity);
+            if (newData == NULL) {
+                free(file->data);
+                file->data = NULL;
+
+                return "Failed to allocate memory (input buffer)";
+            }
+
+            file->data = newData;
+        }
+
+        ssize_t bytesRead = read(fd, file->data + file->size, capacity - file->size);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+
+        if (bytesRead <= 0) {
+            if (bytesRead == 0 && file->size != 0)
+                return NULL;
+
+            free(file->data);
+            file->data = NULL;
+
+            return bytesRead == 0 ? "The input is empty." : "The input could not be read.";
+        }
+
+        file->size += bytesRead;
+    }
+}
+
+// Must be closed after opening
+void MappedFileOpenFd(MappedFile* file, int fd) {
+    const char* error = MappedFileLoad(file, fd);
+    if (error != NULL)
+        panic(error);
+}
+
+// Same as MappedFileOpenFd; "-" reads standard input.
+// Must be closed after opening
+void MappedFileOpen(MappedFile* file, const char* path) {
+    int fd = STDIN_FILENO;
+
+    if (strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            panic("The input image binary could not be opened.");
+    }
+
+    // The mapping stays valid once the descriptor is closed
+    const char* error = MappedFileLoad(file, fd);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+
+    if (error != NULL)
+        panic(error);
+}
+
+void MappedFileClose(MappedFile* file) {
+    if (file->data == NULL)
+        return;
+
+    if (file->mapped)
+        munmap(file->data, file->size);
+    else
+        free(file->data);
+
+    file->data = NULL;
+}
+
+void writeFileBinary(const char* path, u8* data, u64 size) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL)
+        panic("The output image binary could not be opened for writing. Does the directory exist?");
+
+    u64 bytesWritten = fwrite(data, 1, size, fp);
+
+    if (fclose(fp) != 0 || bytesWritten != size)
+        panic("The output image binary could not be written.");
+}
+
+typedef struct {
+    char** paths;
+    u32 count;
+    u32 capacity;
+} PathList;
+
+void PathListAdd(PathList* list, const char* path) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->paths = (char**)realloc(list->paths, list->capacity * sizeof(char*));
+        if (list->paths == NULL)
+            panic("Failed to allocate memory (path list)");
+    }
+
+    list->paths[list->count] = strdup(path);
+    if (list->paths[list->count] == NULL)
+        panic("Failed to allocate memory (path list)");
+
+    list->count++;
+}
+
+// Drops every path after the first count
+void PathListTruncate(PathList* list, u32 count) {
+    while (list->count > count)
+        free(list->paths[--list->count]);
+}
+
+void PathListFree(PathList* list) {
+    for (u32 i = 0; i < list->count; i++)
+        free(list->paths[i]);
+    free(list->paths);
+
+    memset(list, 0, sizeof(PathList));
+}
+
+typedef void (*WalkCallback)(const char* path, void* userData);
+
+// Recursively visits every regular file below root (symlinks are not followed).
+void walkDirectory(const char* root, WalkCallback callback, void* userData) {
+    DIR* dir = opendir(root);
+    if (dir == NULL) {
+        warn("A directory could not be opened, skipping.");
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", root, entry->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            walkDirectory(path, callback, userData);
+        else if (S_ISREG(st.st_mode))
+            callback(path, userData);
+    }
+
+    closedir(dir);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <strings.h>
+
+#include "common.h"
+
+// Instruction set level the pixel kernels run at. It is picked once at
+// startup (CpuInit) and every kernel table is indexed by it, so no kernel
+// call checks the CPU itself. Levels are ordered: a CPU that supports one
+// supports every level below it.
+
+#define CPU_SCALAR 0
+#define CPU_SSE41  1
+#define CPU_AVX2   2
+#define CPU_AVX512 3
+#define CPU_LEVEL_COUNT 4
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#endif
+
+const char* cpuLevelNames[CPU_LEVEL_COUNT] = { "scalar", "sse4.1", "avx2", "avx512" };
+
+int cpuLevel = CPU_SCALAR;
+
+// Highest level this CPU supports
+int CpuDetect(void) {
+#ifdef CPU_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return CPU_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return CPU_SSE41;
+#endif
+
+    return CPU_SCALAR;
+}
+
+// Level named name ("scalar", "sse4.1", "avx2" or "avx512"), or -1
+int CpuParseLevel(const char* name) {
+    for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+        if (strcasecmp(name, cpuLevelNames[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+// Picks the level for this run: the highest supported one, unless forced
+// (by --cpu, or else the IMAGETOOL_CPU environment variable) to a lower one
+// for testing. Forcing a level the CPU can't run falls back to the highest
+// supported one with a warning.
+void CpuInit(const char* forcedName) {
+    int supported = CpuDetect();
+
+    if (forcedName == NULL)
+        forcedName = getenv("IMAGETOOL_CPU");
+
+    cpuLevel = supported;
+
+    if (forcedName == NULL || forcedName[0] == '\0')
+        return;
+
+    int forced = CpuParseLevel(forcedName);
+
+    char message[128];
+
+    if (forced < 0) {
+        snprintf(message, sizeof(message), "Unknown CPU level '%s'; using %s.", forcedName, cpuLevelNames[supported]);
+        warn(message);
+    }
+    else if (forced > supported) {
+        snprintf(message, sizeof(message), "This CPU does not support %s; using %s.", cpuLevelNames[forced], cpuLevelNames[supported]);
+        warn(message);
+    }
+    else
+        cpuLevel = forced;
+}
+
+#endif
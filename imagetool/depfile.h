@@ -0,0 +1,58 @@
+#ifndef DEPFILE_H
+#define DEPFILE_H
+
+#include "common.h"
+
+// Make-compatible dependency files ("out1 out2: in1 in2"), as read by make's
+// include and ninja's depfile = ...
+
+void DepfileWritePath(FILE* fp, const char* path) {
+    for (const char* c = path; *c; c++) {
+        if (*c == ' ' || *c == '#')
+            fputc('\\', fp);
+        else if (*c == '$')
+            fputc('$', fp);
+
+        fputc(*c, fp);
+    }
+}
+
+// Writes one rule. Does nothing if there are no outputs.
+void DepfileWriteRule(FILE* fp, PathList* outputs, const char** inputs, u32 inputCount) {
+    if (outputs->count == 0)
+        return;
+
+    for (u32 i = 0; i < outputs->count; i++) {
+        if (i != 0)
+            fputs(" \\\n ", fp);
+        DepfileWritePath(fp, outputs->paths[i]);
+    }
+
+    fputc(':', fp);
+
+    for (u32 i = 0; i < inputCount; i++) {
+        if (inputs[i] == NULL)
+            continue;
+
+        fputs(" \\\n ", fp);
+        DepfileWritePath(fp, inputs[i]);
+    }
+
+    fputc('\n', fp);
+}
+
+// Must be closed with DepfileClose
+FILE* DepfileOpen(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+        panic("The dependency file could not be opened for writing.");
+
+    return fp;
+}
+
+void DepfileClose(FILE* fp) {
+    if (fclose(fp) != 0)
+        panic("The dependency file could not be written.");
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "common.h"
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash). zstd links its own
+// copy but doesn't export it, so it's reimplemented here.
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ull
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME64_3 0x165667B19E3779F9ull
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ull
+
+typedef struct {
+    u64 totalLength;
+    u64 acc[4];
+
+    u8 buffer[32];
+    u32 bufferSize;
+} Hash64;
+
+static inline u64 hashRotl64(u64 x, unsigned r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 hashRead64(const u8* p) {
+    u64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u32 hashRead32(const u8* p) {
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u64 hashRound(u64 acc, u64 input) {
+    acc += input * XXH_PRIME64_2;
+    acc = hashRotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline u64 hashMergeRound(u64 acc, u64 val) {
+    acc ^= hashRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void Hash64Init(Hash64* hash, u64 seed) {
+    memset(hash, 0, sizeof(Hash64));
+
+    hash->acc[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    hash->acc[1] = seed + XXH_PRIME64_2;
+    hash->acc[2] = seed;
+    hash->acc[3] = seed - XXH_PRIME64_1;
+}
+
+void Hash64Update(Hash64* hash, const void* data, u64 size) {
+    const u8* p = (const u8*)data;
+    const u8* end = p + size;
+
+    hash->totalLength += size;
+
+    if (hash->bufferSize + size < 32) {
+        memcpy(hash->buffer + hash->bufferSize, p, size);
+        hash->bufferSize += size;
+        return;
+    }
+
+    if (hash->bufferSize != 0) {
+        u32 fill = 32 - hash->bufferSize;
+        memcpy(hash->buffer + hash->bufferSize, p, fill);
+        p += fill;
+
+        for (unsigned i = 0; i < 4; i++)
+            hash->acc[i] = hashRound(hash->acc[i], hashRead64(hash->buffer + i * 8));
+
+        hash->bufferSize = 0;
+    }
+
+    while (p + 32 <= end) {
+        for (unsigned i = 0; i < 4; i++)
+            hash->acc[i] = hashRound(hash->acc[i], hashRead64(p + i * 8));
+        p += 32;
+    }
+
+    if (p < end) {
+        memcpy(hash->buffer, p, end - p);
+        hash->bufferSize = end - p;
+    }
+}
+
+u64 Hash64Digest(Hash64* hash) {
+    u64 h;
+
+    if (hash->totalLength >= 32) {
+        h =
+            hashRotl64(hash->acc[0], 1) + hashRotl64(hash->acc[1], 7) +
+            hashRotl64(hash->acc[2], 12) + hashRotl64(hash->acc[3], 18);
+
+        for (unsigned i = 0; i < 4; i++)
+            h = hashMergeRound(h, hash->acc[i]);
+    }
+    else
+        h = hash->acc[2] + XXH_PRIME64_5;
+
+    h += hash->totalLength;
+
+    const u8* p = hash->buffer;
+    const u8* end = p + hash->bufferSize;
+
+    while (p + 8 <= end) {
+        h ^= hashRound(0, hashRead64(p));
+        h = hashRotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (u64)hashRead32(p) * XXH_PRIME64_1;
+        h = hashRotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = hashRotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include <zstd.h>
+#include <pthread.h>
 
 // GL(EXT) definitions
 #define GL_RGBA       0x1908
@@ -19,8 +20,62 @@
 #include "stb/stb_image_write.h"
 
 #include "common.h"
+#include "mipmap.h"
 
 #define RECOMPRESS_LVL 6
+#define OPTIMIZE_LVL 19 // --optimize without --level
+
+// Decoders (the game's included) only accept larger windows when told to
+#define IMAGE_WINDOWLOG_MIN 10
+#define IMAGE_WINDOWLOG_MAX 27
+
+// zstd settings for created images
+typedef struct {
+    int level;
+    int windowLog; // Long-distance matching window (log2); 0 leaves it off
+    int workers; // zstd worker threads; 0 compresses on the calling thread
+    u32 jobSize; // Input bytes per worker job; 0 lets zstd choose
+    u32 autoBudgetMs; // Pick level and windowLog per texture (see ImageWriterWriteKTXAuto); 0 uses them as given
+} ImageCompressParams;
+
+#define IMAGE_COMPRESS_PARAMS_DEFAULT { .level = RECOMPRESS_LVL, .windowLog = 0, .workers = 0, .jobSize = 0, .autoBudgetMs = 0 }
+
+// --auto tries these in order, roughly cheapest first
+const struct {
+    int level;
+    int windowLog;
+} imageAutoCandidates[] = {
+    { 3, 0 }, { 6, 0 }, { 9, 0 }, { 9, IMAGE_WINDOWLOG_MAX }, { 12, 0 },
+    { 15, 0 }, { 15, IMAGE_WINDOWLOG_MAX }, { 19, 0 }, { 19, IMAGE_WINDOWLOG_MAX }
+};
+
+// Returns FALSE if zstd rejected any of the parameters.
+int ImageCompressParamsApply(ZSTD_CCtx* cctx, const ImageCompressParams* params) {
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+
+    int ok = !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, params->level));
+
+    if (params->windowLog > 0) {
+        ok = ok && !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1));
+        ok = ok && !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, params->windowLog));
+    }
+
+    // Still a single frame: the workers compress consecutive jobs of it
+    if (params->workers > 0) {
+        ok = ok && !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, params->workers));
+        ok = ok && !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize, params->jobSize));
+    }
+
+    return ok;
+}
+
+// Level and window only, e.g. "level=19 long=27"
+void ImageCompressParamsDescribe(const ImageCompressParams* params, char* dst, u32 size) {
+    if (params->windowLog > 0)
+        snprintf(dst, size, "level=%d long=%d", params->level, params->windowLog);
+    else
+        snprintf(dst, size, "level=%d", params->level);
+}
 
 #define JPEG_QUALITY_LVL 95
 
@@ -85,9 +140,46 @@ typedef struct __attribute__((packed)) {
     u8 headerEnd[0];
 } KTXHeader;
 
-// Identifier check, endian processing, value correction
-void KTXPreprocess(u8* ktxData) {
-    KTXHeader* ktxHeader = (KTXHeader*)ktxData;
+// Upper bound on numberOfMipmapLevels; 16-bit dimensions never need more
+// than 17 levels
+#define KTX_MAX_LEVELS 32
+
+// Decoded KTX data with the position of every stored level worked out once
+// (by KTXPreprocess), so any level can be reached directly
+typedef struct {
+    u32 offset; // Of the KTXLevel, from the start of the KTX data
+    u32 size;
+    int width, height; // 0 if the level is too small to exist
+} KTXLevelInfo;
+
+typedef struct {
+    u8* data;
+    u64 size;
+
+    u32 levelCount; // Stored levels; KTXCreate data counts one more than it stores
+    KTXLevelInfo levels[KTX_MAX_LEVELS];
+} KTXView;
+
+// Byte-swaps the header fields only (not endianness itself, nor the levels)
+void KTXSwapHeader(KTXHeader* ktxHeader) {
+    ktxHeader->glType = __builtin_bswap32(ktxHeader->glType);
+    ktxHeader->glTypeSize = __builtin_bswap32(ktxHeader->glTypeSize);
+    ktxHeader->glFormat = __builtin_bswap32(ktxHeader->glFormat);
+    ktxHeader->glInternalFormat = __builtin_bswap32(ktxHeader->glInternalFormat);
+    ktxHeader->glBaseInternalFormat = __builtin_bswap32(ktxHeader->glBaseInternalFormat);
+
+    ktxHeader->pixelWidth = __builtin_bswap32(ktxHeader->pixelWidth);
+    ktxHeader->pixelHeight = __builtin_bswap32(ktxHeader->pixelHeight);
+    ktxHeader->pixelDepth = __builtin_bswap32(ktxHeader->pixelDepth);
+
+    ktxHeader->numberOfArrayElements = __builtin_bswap32(ktxHeader->numberOfArrayElements);
+    ktxHeader->numberOfFaces = __builtin_bswap32(ktxHeader->numberOfFaces);
+    ktxHeader->numberOfMipmapLevels = __builtin_bswap32(ktxHeader->numberOfMipmapLevels);
+
+    ktxHeader->bytesOfKeyValueData = __builtin_bswap32(ktxHeader->bytesOfKeyValueData);
+}
+
+void KTXCheckHeader(KTXHeader* ktxHeader) {
     if (memcmp(ktxHeader->identifier, KTX_IDENTIFIER, 12) != 0)
         panic("KTX header identifier is nonmatching");
 
@@ -96,70 +188,260 @@ void KTXPreprocess(u8* ktxData) {
         ktxHeader->endianness != KTX_BIG_ENDIAN
     )
         panic("KTX header has bad endianness value");
+}
 
-    if (ktxHeader->endianness == KTX_BIG_ENDIAN) {
-        ktxHeader->glType = __builtin_bswap32(ktxHeader->glType);
-        ktxHeader->glTypeSize = __builtin_bswap32(ktxHeader->glTypeSize);
-        ktxHeader->glFormat = __builtin_bswap32(ktxHeader->glFormat);
-        ktxHeader->glInternalFormat = __builtin_bswap32(ktxHeader->glInternalFormat);
-        ktxHeader->glBaseInternalFormat = __builtin_bswap32(ktxHeader->glBaseInternalFormat);
-
-        ktxHeader->pixelWidth = __builtin_bswap32(ktxHeader->pixelWidth);
-        ktxHeader->pixelHeight = __builtin_bswap32(ktxHeader->pixelHeight);
-        ktxHeader->pixelDepth = __builtin_bswap32(ktxHeader->pixelDepth);
+// Value correction
+void KTXFixHeader(KTXHeader* ktxHeader) {
+    if (ktxHeader->numberOfMipmapLevels == 0)
+        ktxHeader->numberOfMipmapLevels = 1;
+    if (ktxHeader->numberOfArrayElements == 0)
+        ktxHeader->numberOfArrayElements = 1;
 
-        ktxHeader->numberOfArrayElements = __builtin_bswap32(ktxHeader->numberOfArrayElements);
-        ktxHeader->numberOfFaces = __builtin_bswap32(ktxHeader->numberOfFaces);
-        ktxHeader->numberOfMipmapLevels = __builtin_bswap32(ktxHeader->numberOfMipmapLevels);
+    if (ktxHeader->pixelHeight == 0)
+        ktxHeader->pixelHeight = 1;
+    if (ktxHeader->pixelDepth == 0)
+        ktxHeader->pixelDepth = 1;
+}
 
-        ktxHeader->bytesOfKeyValueData = __builtin_bswap32(ktxHeader->bytesOfKeyValueData);
+// Dimensions of level mipIndex. Returns FALSE if the level is too small to exist.
+int KTXGetMipSize(KTXHeader* ktxHeader, u32 mipIndex, int* widthOut, int* heightOut) {
+    *widthOut = ktxHeader->pixelWidth / pow(2, mipIndex);
+    *heightOut = ktxHeader->pixelHeight / pow(2, mipIndex);
 
-        // Process levels
-        {
-            u8* basePtr = ktxHeader->headerEnd + ktxHeader->bytesOfKeyValueData;
-            u8* ptr = basePtr;
-            for (unsigned i = 0; i < ktxHeader->numberOfMipmapLevels; i++) {
-                ((KTXLevel*)ptr)->imageSize = __builtin_bswap32(((KTXLevel*)ptr)->imageSize);
+    return *widthOut > 0 && *heightOut > 0;
+}
 
-                ptr += sizeof(KTXLevel) + ((KTXLevel*)ptr)->imageSize;
+// Identifier check, endian processing, value correction
+void KTXPreprocess(u8* ktxData, u64 ktxSize, KTXView* viewOut) {
+    KTXHeader* ktxHeader = (KTXHeader*)ktxData;
 
-                u32 offset = ptr - basePtr;
-                u32 padding = (4 - (offset % 4)) % 4;
+    if (ktxSize < sizeof(KTXHeader))
+        panic("KTX data is too small to hold a header");
 
-                ptr += padding;
-            }
-        }
+    KTXCheckHeader(ktxHeader);
 
+    int bigEndian = ktxHeader->endianness == KTX_BIG_ENDIAN;
+    if (bigEndian) {
+        KTXSwapHeader(ktxHeader);
         ktxHeader->endianness = KTX_LITTLE_ENDIAN;
     }
 
-    if (ktxHeader->numberOfMipmapLevels == 0)
-        ktxHeader->numberOfMipmapLevels = 1;
-    if (ktxHeader->numberOfArrayElements == 0)
-        ktxHeader->numberOfArrayElements = 1;
+    KTXFixHeader(ktxHeader);
 
-    if (ktxHeader->pixelHeight == 0)
-        ktxHeader->pixelHeight = 1;
-    if (ktxHeader->pixelDepth == 0)
-        ktxHeader->pixelDepth = 1;
+    if (ktxHeader->numberOfMipmapLevels > KTX_MAX_LEVELS)
+        panic("KTX header has too many mipmap levels");
+
+    viewOut->data = ktxData;
+    viewOut->size = ktxSize;
+    viewOut->levelCount = 0;
+
+    u64 baseOffset = sizeof(KTXHeader) + (u64)ktxHeader->bytesOfKeyValueData;
+    u64 offset = baseOffset;
+
+    for (unsigned i = 0; i < ktxHeader->numberOfMipmapLevels; i++) {
+        // Files made by KTXCreate claim one level more than they hold
+        if (offset >= ktxSize)
+            break;
+
+        if (offset + sizeof(KTXLevel) > ktxSize)
+            panic("KTX data is truncated");
+
+        KTXLevel* level = (KTXLevel*)(ktxData + offset);
+        if (bigEndian)
+            level->imageSize = __builtin_bswap32(level->imageSize);
+
+        if (offset + sizeof(KTXLevel) + level->imageSize > ktxSize)
+            panic("KTX level is larger than the KTX data");
+
+        KTXLevelInfo* info = &viewOut->levels[i];
+        info->offset = offset;
+        info->size = level->imageSize;
+        if (!KTXGetMipSize(ktxHeader, i, &info->width, &info->height))
+            info->width = info->height = 0;
+
+        viewOut->levelCount++;
+
+        offset += sizeof(KTXLevel) + level->imageSize;
+
+        // Padding to 4 bytes; may be missing after the last level
+        offset += (4 - ((offset - baseOffset) % 4)) % 4;
+    }
 }
 
 u32 KTXGetGLFormat(u8* ktxData) {
     return ((KTXHeader*)ktxData)->glInternalFormat;
 }
 
-u32 KTXGetPixelComp(u8* ktxData) {
-    switch (KTXGetGLFormat(ktxData)) {
-    case GL_RGB4_EXT:
-        return 3;
-    case GL_RGBA8_EXT:
-        return 4;
-    case GL_RGBA16_EXT:
-        return 8;
-    
-    default:
-        return 4;
+// Converts count pixels of a row to 8-bit channels, starting at pixel start.
+// Returns how many were done; vector kernels leave the last few to the
+// caller.
+typedef u32 (*KTXConvertKernel)(u8* dst, const u8* src, u32 start, u32 count);
+
+// How each KTX internal format is written out. A texture's format is looked
+// up once (KTXGetFormat). Formats written out as stored (RGBA8 above all)
+// need no conversion; the others convert whole rows at a time, with a
+// kernel for each CPU level.
+// Mip filtering only ever sees RGBA8 and doesn't go through this.
+typedef struct {
+    u32 glInternalFormat;
+    const char* name;
+
+    u32 pixelSize;  // Bytes per pixel of the KTX data
+    u32 outputComp; // 8-bit channels per pixel when written out
+
+    // Converts pixels to outputComp channel pixels, indexed by CPU level;
+    // NULL if the data is written out as stored
+    const KTXConvertKernel* convertKernels;
+} KTXFormat;
+
+// Little endian 16-bit channels, rounded to 8 bits:
+// (value * 255 + 32767) / 65535, which for every 16-bit value is the same
+// as (value * 255 + 32895) >> 16. The vector kernels use the latter.
+u32 KTXConvertRGBA16Scalar(u8* dst, const u8* src, u32 start, u32 count) {
+    for (u32 i = start * 4; i < (start + count) * 4; i++) {
+        u32 value = src[i * 2] | (src[i * 2 + 1] << 8);
+        dst[i] = (u8)((value * 255 + 32767) / 65535);
+    }
+
+    return count;
+}
+
+#ifdef CPU_X86
+
+// Four pixels per step. Channels are widened to 32 bits, where value * 255
+// is (value << 8) - value, then narrowed back down with saturating packs
+// (which never saturate, as every result fits in 8 bits).
+__attribute__((target("sse4.1")))
+u32 KTXConvertRGBA16SSE41(u8* dst, const u8* src, u32 start, u32 count) {
+    const __m128i bias = _mm_set1_epi32(32895);
+
+    u32 i = start;
+
+    for (; i + 4 <= start + count; i += 4) {
+        __m128i x[4];
+
+        // One pixel per 8 bytes
+        for (unsigned k = 0; k < 4; k++) {
+            __m128i value = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(src + i * 8 + k * 8)));
+            value = _mm_sub_epi32(_mm_slli_epi32(value, 8), value);
+
+            x[k] = _mm_srli_epi32(_mm_add_epi32(value, bias), 16);
+        }
+
+        __m128i lo = _mm_packus_epi32(x[0], x[1]);
+        __m128i hi = _mm_packus_epi32(x[2], x[3]);
+
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+
+    return i - start;
+}
+
+// Same as KTXConvertRGBA16SSE41, eight pixels per step. The 256-bit packs
+// work within 128-bit lanes, so the result is put back in order at the end.
+__attribute__((target("avx2")))
+u32 KTXConvertRGBA16AVX2(u8* dst, const u8* src, u32 start, u32 count) {
+    const __m256i bias = _mm256_set1_epi32(32895);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    u32 i = start;
+
+    for (; i + 8 <= start + count; i += 8) {
+        __m256i x[4];
+
+        // Two pixels per 16 bytes
+        for (unsigned k = 0; k < 4; k++) {
+            __m256i value = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i * 8 + k * 16)));
+            value = _mm256_sub_epi32(_mm256_slli_epi32(value, 8), value);
+
+            x[k] = _mm256_srli_epi32(_mm256_add_epi32(value, bias), 16);
+        }
+
+        // Lanes hold pixels (0, 2, 4, 6 | 1, 3, 5, 7)
+        __m256i lo = _mm256_packus_epi32(x[0], x[1]);
+        __m256i hi = _mm256_packus_epi32(x[2], x[3]);
+
+        __m256i packed = _mm256_packus_epi16(lo, hi);
+
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_permutevar8x32_epi32(packed, order));
+    }
+
+    return i - start;
+}
+
+// Same again, sixteen pixels per step. Lane l of the packed result holds
+// pixels l, l + 4, l + 8 and l + 12.
+__attribute__((target("avx512f,avx512bw")))
+u32 KTXConvertRGBA16AVX512(u8* dst, const u8* src, u32 start, u32 count) {
+    const __m512i bias = _mm512_set1_epi32(32895);
+    const __m512i order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+
+    u32 i = start;
+
+    for (; i + 16 <= start + count; i += 16) {
+        __m512i x[4];
+
+        // Four pixels per 32 bytes
+        for (unsigned k = 0; k < 4; k++) {
+            __m512i value = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(src + i * 8 + k * 32)));
+            value = _mm512_sub_epi32(_mm512_slli_epi32(value, 8), value);
+
+            x[k] = _mm512_srli_epi32(_mm512_add_epi32(value, bias), 16);
+        }
+
+        __m512i lo = _mm512_packus_epi32(x[0], x[1]);
+        __m512i hi = _mm512_packus_epi32(x[2], x[3]);
+
+        __m512i packed = _mm512_packus_epi16(lo, hi);
+
+        _mm512_storeu_si512((void*)(dst + i * 4), _mm512_permutexvar_epi32(order, packed));
+    }
+
+    return i - start;
+}
+
+#endif
+
+const KTXConvertKernel ktxConvertRGBA16Kernels[CPU_LEVEL_COUNT] = {
+    [CPU_SCALAR] = KTXConvertRGBA16Scalar,
+#ifdef CPU_X86
+    [CPU_SSE41]  = KTXConvertRGBA16SSE41,
+    [CPU_AVX2]   = KTXConvertRGBA16AVX2,
+    [CPU_AVX512] = KTXConvertRGBA16AVX512
+#else
+    [CPU_SSE41]  = KTXConvertRGBA16Scalar,
+    [CPU_AVX2]   = KTXConvertRGBA16Scalar,
+    [CPU_AVX512] = KTXConvertRGBA16Scalar
+#endif
+};
+
+// The first entry is also used for unknown formats
+const KTXFormat ktxFormats[] = {
+    { GL_RGBA8_EXT,  "RGBA8",  4, 4, NULL },
+    { GL_RGB4_EXT,   "RGB4",   3, 3, NULL },
+    { GL_RGBA16_EXT, "RGBA16", 8, 4, ktxConvertRGBA16Kernels }
+};
+
+// NULL for unknown formats
+const KTXFormat* KTXFindFormat(u32 glInternalFormat) {
+    for (unsigned i = 0; i < sizeof(ktxFormats) / sizeof(ktxFormats[0]); i++) {
+        if (ktxFormats[i].glInternalFormat == glInternalFormat)
+            return &ktxFormats[i];
     }
+
+    return NULL;
+}
+
+const KTXFormat* KTXGetFormat(u8* ktxData) {
+    const KTXFormat* format = KTXFindFormat(KTXGetGLFormat(ktxData));
+    return format ? format : &ktxFormats[0];
+}
+
+// Converts count pixels of a format with convertKernels, at the CPU level
+// picked at startup.
+void KTXConvertPixels(const KTXFormat* format, u8* dst, const u8* src, u32 count) {
+    u32 done = format->convertKernels[cpuLevel](dst, src, 0, count);
+    format->convertKernels[CPU_SCALAR](dst, src, done, count - done);
 }
 
 u32 KTXGetLevelCount(u8* ktxData) {
@@ -176,25 +458,76 @@ KTXLevel* KTXGetLevelZero(u8* ktxData) {
     return (KTXLevel*)(ktxHeader->headerEnd + ktxHeader->bytesOfKeyValueData);
 }
 
-KTXLevel* KTXGetLevel(u8* ktxData, u32 mipIndex) {
-    KTXHeader* ktxHeader = (KTXHeader*)ktxData;
+// Stored level mipIndex, or NULL if the data ends before it (like the
+// counted but unstored last level of KTXCreate)
+KTXLevel* KTXGetLevel(const KTXView* view, u32 mipIndex) {
+    if (mipIndex >= view->levelCount)
+        return NULL;
 
-    u8* basePtr = ktxHeader->headerEnd + ktxHeader->bytesOfKeyValueData;
-    u8* ptr = basePtr;
+    return (KTXLevel*)(view->data + view->levels[mipIndex].offset);
+}
 
-    if (mipIndex >= ktxHeader->numberOfMipmapLevels)
-        panic("Bad mipIndex: out of bounds");
+// Checks that the header and both compressed payloads lie within the file.
+void ImageCheckSize(u8* imageData, u64 imageSize) {
+    if (imageSize < sizeof(ImageFileHeader))
+        panic("The image binary is too small to hold a header.");
 
-    for (unsigned i = 0; i < mipIndex; i++) {
-        ptr += sizeof(KTXLevel) + ((KTXLevel*)ptr)->imageSize;
+    ImageFileHeader* fileHeader = (ImageFileHeader*)imageData;
 
-        u32 offset = ptr - basePtr;
-        u32 padding = (4 - (offset % 4)) % 4;
+    u64 payloadSize =
+        (u64)fileHeader->compressedDataSize + fileHeader->maskCompressedDataSize;
+    if (payloadSize > imageSize - sizeof(ImageFileHeader))
+        panic("The image binary is truncated.");
+}
 
-        ptr += padding;
+// Reads only the ImageFileHeader of a .image file. Returns FALSE if the file
+// can't be read or isn't a .image file; doesn't panic.
+int ImageReadHeader(const char* path, ImageFileHeader* headerOut) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return FALSE;
+
+    u64 bytesRead = fread(headerOut, 1, sizeof(ImageFileHeader), fp);
+    fclose(fp);
+
+    return bytesRead == sizeof(ImageFileHeader) && headerOut->magic == IMAGE_MAGIC;
+}
+
+// Reads the ImageFileHeader of a .image file and the window its KTX frame
+// needs to be streamed, from the zstd frame header. Returns FALSE like
+// ImageReadHeader; doesn't panic.
+int ImageReadStreamWindow(const char* path, ImageFileHeader* headerOut, u64* windowOut) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return FALSE;
+
+    // Magic, frame header descriptor and window descriptor
+    u8 frame[6];
+
+    int ok =
+        fread(headerOut, 1, sizeof(ImageFileHeader), fp) == sizeof(ImageFileHeader) &&
+        headerOut->magic == IMAGE_MAGIC &&
+        fread(frame, 1, sizeof(frame), fp) == sizeof(frame);
+
+    fclose(fp);
+
+    if (!ok)
+        return FALSE;
+
+    u64 window = headerOut->decompressedDataSize;
+
+    // Single segment frames are decoded straight into the output
+    int singleSegment = (frame[4] >> 5) & 1;
+    if (!singleSegment) {
+        u64 base = 1ul << (10 + (frame[5] >> 3));
+        u64 descriptorWindow = base + (base / 8) * (frame[5] & 7);
+
+        if (descriptorWindow < window)
+            window = descriptorWindow;
     }
 
-    return (KTXLevel*)ptr;
+    *windowOut = window;
+    return TRUE;
 }
 
 int ImageGetMaskExists(u8* imageData) {
@@ -205,40 +538,301 @@ u16* ImageGetMaskSize(u8* imageData) {
     return &((ImageFileHeader*)imageData)->maskWidth;
 }
 
-// Must be freed after creation
-u8* ImageCreateKTXData(u8* imageData) {
+void ImageCheckHeader(u8* imageData) {
     ImageFileHeader* fileHeader = (ImageFileHeader*)imageData;
     if (fileHeader->magic != IMAGE_MAGIC)
         panic("Image header magic is nonmatching");
 
     if (memcmp((u32*)&fileHeader->width, (u32*)&fileHeader->_width, sizeof(u32)) != 0)
         panic("Image header sizes are nonmatching");
+}
 
-    printf("Alloc KTX decompress buffer (size : %u) ..", fileHeader->decompressedDataSize);
+// viewOut->data is set as soon as it is allocated, so it can be freed after
+// a panic too.
+// viewOut->data must be freed after creation
+void ImageCreateKTXData(u8* imageData, KTXView* viewOut) {
+    ImageFileHeader* fileHeader = (ImageFileHeader*)imageData;
+    ImageCheckHeader(imageData);
+
+    logMsg("Alloc KTX decompress buffer (size : %u) ..", fileHeader->decompressedDataSize);
 
     u8* ktxData = (u8*)malloc(fileHeader->decompressedDataSize);
     if (ktxData == NULL)
         panic("Failed to allocate memory (KTX decompressed buffer)");
 
+    viewOut->data = ktxData;
+
     LOG_OK;
 
-    printf("Decompressing ..");
+    logMsg("Decompressing ..");
 
     u64 zstdResult = ZSTD_decompress(
         ktxData, fileHeader->decompressedDataSize,
         fileHeader->headerEnd, fileHeader->compressedDataSize
     );
 
-    if (ZSTD_isError(zstdResult)) {
-        free(ktxData);
+    if (ZSTD_isError(zstdResult))
         panic("Decompression error");
-    }
 
     LOG_OK;
 
-    KTXPreprocess(ktxData);
+    KTXPreprocess(ktxData, fileHeader->decompressedDataSize, viewOut);
+}
+
+// Decompresses one payload exactly as stored (no KTXPreprocess), for
+// recompressing it. dctx is optional
+// Must be freed after creation
+u8* ImageDecompressPayload(ZSTD_DCtx* dctx, const u8* src, u32 srcSize, u32 dstSize) {
+    u8* dst = (u8*)malloc(dstSize ? dstSize : 1);
+    if (dst == NULL)
+        panic("Failed to allocate memory (payload decompress buffer)");
+
+    u64 zstdResult = dctx ?
+        ZSTD_decompressDCtx(dctx, dst, dstSize, src, srcSize) :
+        ZSTD_decompress(dst, dstSize, src, srcSize);
+
+    if (ZSTD_isError(zstdResult) || zstdResult != dstSize) {
+        free(dst);
+        panic("Decompression error");
+    }
+
+    return dst;
+}
+
+#define KTX_STREAM_OK    0
+#define KTX_STREAM_END   1 // The frame or the input ran out first
+#define KTX_STREAM_ERROR 2
+
+// Which levels to extract, and whether to extract the mask
+typedef struct {
+    u32 levels; // Bit i selects level i (levelzero is bit 0)
+    int last; // Also select the smallest stored level
+    int mask;
+} ImageSelect;
+
+#define IMAGE_SELECT_ALL { .levels = 0xFFFFFFFF, .last = FALSE, .mask = TRUE }
+
+// Levels of a texture that select picks, as a bit set
+u32 ImageSelectLevels(const ImageSelect* select, KTXHeader* ktxHeader) {
+    u32 levels = select->levels;
+
+    // Files made by KTXCreate count one level more than they store, and that
+    // one is too small to exist
+    if (select->last) {
+        for (u32 i = ktxHeader->numberOfMipmapLevels; i-- > 0;) {
+            int mipWidth, mipHeight;
+            if (KTXGetMipSize(ktxHeader, i, &mipWidth, &mipHeight)) {
+                levels |= 1u << i;
+                break;
+            }
+        }
+    }
+
+    return levels;
+}
+
+int ImageSelectIsAll(const ImageSelect* select) {
+    return select->levels == 0xFFFFFFFF && select->mask;
+}
+
+// Parses a comma separated list of levels ("0", "2-4", "last") and "mask" or
+// "all". The mask is only selected if listed. Returns FALSE if spec is invalid.
+int ImageSelectParse(const char* spec, ImageSelect* selectOut) {
+    ImageSelect select = { .levels = 0, .last = FALSE, .mask = FALSE };
+
+    while (*spec != '\0') {
+        u32 length = strcspn(spec, ",");
+        unsigned first, last;
+        int consumed = 0;
+
+        if (length == 3 && strncmp(spec, "all", 3) == 0)
+            select = (ImageSelect)IMAGE_SELECT_ALL;
+        else if (length == 4 && strncmp(spec, "last", 4) == 0)
+            select.last = TRUE;
+        else if (length == 4 && strncmp(spec, "mask", 4) == 0)
+            select.mask = TRUE;
+        else if (
+            sscanf(spec, "%u-%u%n", &first, &last, &consumed) == 2 && (u32)consumed == length &&
+            first <= last && last < 32
+        )
+            select.levels |= (u32)(((u64)1 << (last + 1)) - ((u64)1 << first));
+        else if (sscanf(spec, "%u%n", &first, &consumed) == 1 && (u32)consumed == length && first < 32)
+            select.levels |= 1u << first;
+        else
+            return FALSE;
+
+        spec += length;
+        if (*spec == ',' && *++spec == '\0')
+            return FALSE;
+    }
+
+    if (select.levels == 0 && !select.last && !select.mask)
+        return FALSE;
+
+    *selectOut = select;
+    return TRUE;
+}
+
+// Called with each level as soon as it has been decompressed. levelData is
+// malloc'ed and belongs to the callback from then on.
+typedef void (*KTXLevelCallback)(KTXHeader* ktxHeader, u32 mipIndex, u8* levelData, u32 levelSize, void* userData);
+
+typedef struct {
+    ZSTD_DCtx* dctx;
+    ZSTD_inBuffer input;
+} KTXStream;
+
+// Decompresses exactly size bytes into dst. The number of bytes written is
+// stored to filledOut.
+int KTXStreamRead(KTXStream* stream, void* dst, u64 size, u64* filledOut) {
+    ZSTD_outBuffer output = { .dst = dst, .size = size, .pos = 0 };
+
+    int status = KTX_STREAM_OK;
+
+    while (output.pos < output.size) {
+        u64 inputPos = stream->input.pos;
+        u64 outputPos = output.pos;
+
+        u64 result = ZSTD_decompressStream(stream->dctx, &output, &stream->input);
+        if (ZSTD_isError(result)) {
+            status = KTX_STREAM_ERROR;
+            break;
+        }
+
+        if (output.pos == output.size)
+            break;
+
+        // Frame finished, or nothing left to consume
+        if (result == 0 || (stream->input.pos == inputPos && output.pos == outputPos)) {
+            status = KTX_STREAM_END;
+            break;
+        }
+    }
+
+    if (filledOut != NULL)
+        *filledOut = output.pos;
 
-    return ktxData;
+    return status;
+}
+
+void KTXStreamSkip(KTXStream* stream, u64 size) {
+    u8 scratch[4096];
+
+    while (size > 0) {
+        u64 chunk = size < sizeof(scratch) ? size : sizeof(scratch);
+
+        int status = KTXStreamRead(stream, scratch, chunk, NULL);
+        if (status != KTX_STREAM_OK)
+            panic(status == KTX_STREAM_ERROR ? "Decompression error" : "KTX data is truncated");
+
+        size -= chunk;
+    }
+}
+
+// Starts decompressing the KTX payload of imageData and parses the header
+// into ktxHeaderOut, leaving the stream at the first level size. Returns TRUE
+// if the level data is big endian.
+int KTXStreamBegin(KTXStream* stream, u8* imageData, ZSTD_DCtx* dctx, KTXHeader* ktxHeaderOut) {
+    ImageFileHeader* fileHeader = (ImageFileHeader*)imageData;
+
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+    stream->dctx = dctx;
+    stream->input = (ZSTD_inBuffer){ .src = fileHeader->headerEnd, .size = fileHeader->compressedDataSize, .pos = 0 };
+
+    int status = KTXStreamRead(stream, ktxHeaderOut, sizeof(KTXHeader), NULL);
+    if (status != KTX_STREAM_OK)
+        panic(status == KTX_STREAM_ERROR ? "Decompression error" : "KTX data is too small to hold a header");
+
+    KTXCheckHeader(ktxHeaderOut);
+
+    int bigEndian = ktxHeaderOut->endianness == KTX_BIG_ENDIAN;
+    if (bigEndian) {
+        KTXSwapHeader(ktxHeaderOut);
+        ktxHeaderOut->endianness = KTX_LITTLE_ENDIAN;
+    }
+
+    KTXFixHeader(ktxHeaderOut);
+
+    if (ktxHeaderOut->numberOfMipmapLevels > KTX_MAX_LEVELS)
+        panic("KTX header has too many mipmap levels");
+
+    KTXStreamSkip(stream, ktxHeaderOut->bytesOfKeyValueData);
+
+    return bigEndian;
+}
+
+// Decompresses the KTX payload of imageData front to back, parsing the
+// header and level size prefixes on the way, and hands each level to
+// levelCallback as soon as it is complete. Only the level in progress is
+// held here, never the whole KTX data. Levels that select doesn't pick are
+// decompressed past without being kept, and decompression stops after the
+// last picked level.
+// dctx and select are optional
+void ImageStreamKTX(u8* imageData, ZSTD_DCtx* dctx, const ImageSelect* select, KTXLevelCallback levelCallback, void* userData) {
+    ImageFileHeader* fileHeader = (ImageFileHeader*)imageData;
+    ImageCheckHeader(imageData);
+
+    ZSTD_DCtx* ownDctx = NULL;
+    if (dctx == NULL) {
+        dctx = ownDctx = ZSTD_createDCtx();
+        if (dctx == NULL)
+            panic("Failed to create ZSTD decompression context");
+    }
+
+    KTXStream stream;
+    KTXHeader ktxHeader;
+
+    int bigEndian = KTXStreamBegin(&stream, imageData, dctx, &ktxHeader);
+    int status;
+
+    u32 wanted = select ? ImageSelectLevels(select, &ktxHeader) : 0xFFFFFFFF;
+
+    for (u32 i = 0; i < ktxHeader.numberOfMipmapLevels; i++) {
+        // Nothing else is wanted, leave the rest of the frame alone
+        if ((wanted >> i) == 0)
+            break;
+
+        u32 levelSize;
+        u64 filled;
+
+        status = KTXStreamRead(&stream, &levelSize, sizeof(levelSize), &filled);
+
+        // Files made by KTXCreate claim one level more than they hold
+        if (status == KTX_STREAM_END && filled == 0)
+            break;
+        if (status != KTX_STREAM_OK)
+            panic(status == KTX_STREAM_ERROR ? "Decompression error" : "KTX data is truncated");
+
+        if (bigEndian)
+            levelSize = __builtin_bswap32(levelSize);
+
+        if (levelSize > fileHeader->decompressedDataSize)
+            panic("KTX level is larger than the KTX data");
+
+        if (wanted & (1u << i)) {
+            u8* levelData = (u8*)malloc(levelSize ? levelSize : 1);
+            if (levelData == NULL)
+                panic("Failed to allocate memory (KTX level buffer)");
+
+            status = KTXStreamRead(&stream, levelData, levelSize, NULL);
+            if (status != KTX_STREAM_OK) {
+                free(levelData);
+                panic(status == KTX_STREAM_ERROR ? "Decompression error" : "KTX data is truncated");
+            }
+
+            levelCallback(&ktxHeader, i, levelData, levelSize, userData);
+        }
+        else
+            KTXStreamSkip(&stream, levelSize);
+
+        // Padding to 4 bytes; may be missing after the last level
+        u8 padding[3];
+        if (KTXStreamRead(&stream, padding, (4 - (levelSize % 4)) % 4, NULL) == KTX_STREAM_ERROR)
+            panic("Decompression error");
+    }
+
+    ZSTD_freeDCtx(ownDctx);
 }
 
 // A8 image data
@@ -262,7 +856,7 @@ u8* ImageCreateMaskData(u8* imageData) {
     )
         panic("Unexpected mask data size");
 
-    printf("Alloc mask decompress buffer (size : %u) ..", fileHeader->maskDecompressedDataSize);
+    logMsg("Alloc mask decompress buffer (size : %u) ..", fileHeader->maskDecompressedDataSize);
 
     u8* maskData = (u8*)malloc(fileHeader->maskDecompressedDataSize);
     if (maskData == NULL)
@@ -270,7 +864,7 @@ u8* ImageCreateMaskData(u8* imageData) {
 
     LOG_OK;
 
-    printf("Decompressing ..");
+    logMsg("Decompressing ..");
 
     u64 zstdResult = ZSTD_decompress(
         maskData, fileHeader->maskDecompressedDataSize,
@@ -288,42 +882,39 @@ u8* ImageCreateMaskData(u8* imageData) {
     return maskData;
 }
 
-// Image data must be RGBA8
-// Must be freed after creation
-u8* KTXCreate(u8* imageData, u16 imageWidth, u16 imageHeight, u32* ktxSizeOut) {
-    u64 dataSectionSize =
-        sizeof(KTXLevel) +
-        (imageWidth * imageHeight * 4);
-
+// Number of levels KTXCreate stores for an image, levelzero included
+u32 KTXGetCreateMipCount(u16 imageWidth, u16 imageHeight) {
     u16 mipmapsWidth = bitLength(imageWidth);
     u16 mipmapsHeight = bitLength(imageHeight);
-    u32 mipCount = (mipmapsWidth < mipmapsHeight) ? mipmapsWidth : mipmapsHeight;
 
-    // Skip levelzero
-    for (unsigned i = 1; i < mipCount; i++) {
-        float divBy = powf(2, i);
-        u32 width = imageWidth / divBy;
-        u32 height = imageHeight / divBy;
+    return (mipmapsWidth < mipmapsHeight) ? mipmapsWidth : mipmapsHeight;
+}
 
+// Size of level mipIndex as stored by KTXCreate
+u32 KTXGetCreateLevelSize(u16 imageWidth, u16 imageHeight, u32 mipIndex) {
+    float divBy = powf(2, mipIndex);
+    u32 width = imageWidth / divBy;
+    u32 height = imageHeight / divBy;
+
+    return width * height * 4;
+}
+
+// Size of the whole KTX data KTXCreate makes for an image
+u64 KTXGetCreateSize(u16 imageWidth, u16 imageHeight) {
+    u64 dataSectionSize = 0;
+
+    for (unsigned i = 0; i < KTXGetCreateMipCount(imageWidth, imageHeight); i++) {
         dataSectionSize +=
             sizeof(KTXLevel) +
-            (width * height * 4);
+            KTXGetCreateLevelSize(imageWidth, imageHeight, i);
 
         // No padding needed since RGBA8 naturally rounds to 4.
     }
 
-    u64 fullSize = sizeof(KTXHeader) + dataSectionSize;
-
-    printf("Alloc KTX buffer (size : %lu) ..", fullSize);
-
-    u8* ktxData = (u8*)malloc(fullSize);
-    if (ktxData == NULL)
-        panic("Failed to allocate memory (KTX buffer)");
-
-    LOG_OK;
-
-    KTXHeader* ktxHeader = (KTXHeader*)ktxData;
+    return sizeof(KTXHeader) + dataSectionSize;
+}
 
+void KTXInitHeader(KTXHeader* ktxHeader, u16 imageWidth, u16 imageHeight) {
     memcpy(ktxHeader->identifier, KTX_IDENTIFIER, 12);
 
     ktxHeader->endianness = KTX_LITTLE_ENDIAN;
@@ -338,273 +929,865 @@ u8* KTXCreate(u8* imageData, u16 imageWidth, u16 imageHeight, u32* ktxSizeOut) {
     ktxHeader->pixelHeight = imageHeight;
     ktxHeader->pixelDepth = 1;
 
-    ktxHeader->numberOfMipmapLevels = mipCount + 1; // Including levelzero
+    ktxHeader->numberOfMipmapLevels = KTXGetCreateMipCount(imageWidth, imageHeight) + 1; // Including levelzero
 
     ktxHeader->numberOfArrayElements = 1;
     ktxHeader->numberOfFaces = 0;
 
     ktxHeader->bytesOfKeyValueData = 0;
+}
+
+// Allocates the KTX buffer for an RGBA8 image, fills in the header and
+// every level size and copies levelzero. The other levels are left for
+// KTXCreateLevels; viewOut->levelCount is how many levels are stored
+// (levelzero included).
+// Image data must be RGBA8
+// viewOut->data must be freed after creation, even if this panics
+void KTXAllocate(u8* imageData, u16 imageWidth, u16 imageHeight, KTXView* viewOut) {
+    u32 mipCount = KTXGetCreateMipCount(imageWidth, imageHeight);
+    u64 fullSize = KTXGetCreateSize(imageWidth, imageHeight);
+
+    logMsg("Alloc KTX buffer (size : %lu) ..", fullSize);
+
+    u8* ktxData = (u8*)malloc(fullSize);
+    if (ktxData == NULL)
+        panic("Failed to allocate memory (KTX buffer)");
+
+    viewOut->data = ktxData;
+
+    LOG_OK;
+
+    KTXHeader* ktxHeader = (KTXHeader*)ktxData;
+    KTXInitHeader(ktxHeader, imageWidth, imageHeight);
 
     KTXLevel* levelZero = (KTXLevel*)ktxHeader->headerEnd;
 
     levelZero->imageSize = imageWidth * imageHeight * 4;
     memcpy(levelZero->data, imageData, levelZero->imageSize);
 
-    for (unsigned int i = 1; i < mipCount; i++) {
-        KTXLevel* level = KTXGetLevel(ktxData, i);
-
-        float divBy = powf(2, i);
-        u32 newWidth = imageWidth / divBy;
-        u32 newHeight = imageHeight / divBy;
-
-        level->imageSize = newWidth * newHeight * 4;
-
-        // Bilinear scaling
-        {
-            float xRatio = (float)(imageWidth - 1) / newWidth;
-            float yRatio = (float)(imageHeight - 1) / newHeight;
-
-            for (unsigned i = 0; i < newHeight; i++) {
-                for (unsigned j = 0; j < newWidth; j++) {
-                    unsigned x     = (unsigned)(xRatio * j);
-                    unsigned y     = (unsigned)(yRatio * i);
-                    float    xDiff = (xRatio * j) - x;
-                    float    yDiff = (yRatio * i) - y;
-
-                    unsigned index = (y * imageWidth + x) * 4;
-
-                    for (unsigned c = 0; c < 4; c++) {
-                        level->data[(i * newWidth + j) * 4 + c] = (u8)(
-                            imageData[index + c] * (1 - xDiff) * (1 - yDiff) +
-                            imageData[index + 4 + c] * xDiff * (1 - yDiff) +
-                            imageData[(y + 1) * imageWidth * 4 + x * 4 + c] * (1 - xDiff) * yDiff +
-                            imageData[(y + 1) * imageWidth * 4 + (x + 1) * 4 + c] * xDiff * yDiff
-                        );
-                    }
-                }
-            }
-        }
+    // Sizes go in first so KTXGetLevel can find any level right away
+    u8* ptr = levelZero->data + levelZero->imageSize;
+    for (unsigned i = 1; i < mipCount; i++) {
+        KTXLevel* level = (KTXLevel*)ptr;
+        level->imageSize = KTXGetCreateLevelSize(imageWidth, imageHeight, i);
+
+        ptr += sizeof(KTXLevel) + level->imageSize;
     }
 
-    if (ktxSizeOut != NULL)
-        *ktxSizeOut = fullSize;
+    KTXPreprocess(ktxData, fullSize, viewOut);
+}
 
-    return ktxData;
+// Fills in levels of a KTXAllocate buffer for MipGenerate and friends.
+void KTXGetLevelPointers(const KTXView* view, u8** levelsOut) {
+    for (u32 i = 0; i < view->levelCount; i++)
+        levelsOut[i] = KTXGetLevel(view, i)->data;
 }
 
+// Generates every level after levelzero of a KTXAllocate buffer, each from
+// the one before it, a levelzero tile at a time. With a pool the tiles are
+// spread over its workers (see MipChain); pool may be NULL.
+void KTXCreateLevels(const KTXView* view, ThreadPool* pool) {
+    u8* levels[KTX_MAX_LEVELS];
+    KTXGetLevelPointers(view, levels);
+
+    if (pool) {
+        MipChain* chain = MipChainCreate(levels, view->levelCount, view->levels[0].width, view->levels[0].height);
+
+        MipChainStart(chain, pool, NULL, NULL, 0);
+        MipChainWait(chain);
+
+        MipChainDestroy(chain);
+    }
+    else
+        MipGenerate(levels, view->levelCount, view->levels[0].width, view->levels[0].height);
+}
+
+// Image data must be RGBA8
 // Must be freed after creation
-u8* ImageCreate(u8* ktxData, u32 ktxSize, u8* maskData, u16 maskWidth, u16 maskHeight, u32* imageSizeOut) {
-    u8* ktxCompressedBuf;
+u8* KTXCreate(u8* imageData, u16 imageWidth, u16 imageHeight, u32* ktxSizeOut) {
+    KTXView view;
+    KTXAllocate(imageData, imageWidth, imageHeight, &view);
+    KTXCreateLevels(&view, NULL);
+
+    if (ktxSizeOut != NULL)
+        *ktxSizeOut = view.size;
+
+    return view.data;
+}
+
+// Writes a .image file without holding it in memory. The file header is
+// reserved, KTX data is compressed as it is fed and goes straight to the
+// file, then ImageWriterFinish appends the mask and fills in the header.
+// With zstd worker threads enabled the mask is compressed on a thread of its
+// own while the KTX data is being fed.
+typedef struct {
+    FILE* fp;
+    char path[PATH_MAX];
+
+    ImageCompressParams params;
+    ImageCompressParams chosen; // What the KTX data was compressed with
+
+    ZSTD_CCtx* cctx;
+    ZSTD_CCtx* ownCctx; // Created here if no context was passed
+
+    u8* outBuf;
+    u64 outBufSize;
+
+    u8* levelBuf; // ImageWriterGenerateKTX
+    MipChain* levelChain; // ImageWriterGenerateKTX with a pool, building into levelBuf
+
+    // ImageWriterWriteKTXAuto
+    int ktxPrecompressed;
+    u8* autoBuf[2];
+    u64 autoSize;
+    double autoMs;
+
+    u16 width;
+    u16 height;
+    u64 ktxSize;
+
     u64 ktxCompressedSize;
+    u64 maskCompressedSize;
 
-    u8* maskCompressedBuf = NULL;
-    u64 maskCompressedSize = 0;
+    // ImageWriterSetMask
+    u8* maskData;
+    u16 maskWidth;
+    u16 maskHeight;
 
-    // KTX compression
-    {
-        u64 maxCompressedSize = ZSTD_compressBound(ktxSize);
+    const u8* maskFrame; // ImageWriterSetCompressedMask
 
-        printf("Alloc KTX compress buffer (size : %lu) ..", maxCompressedSize);
-        ktxCompressedBuf = (u8*)malloc(maxCompressedSize);
-        if (ktxCompressedBuf == NULL)
-            panic("Failed to allocate memory (KTX compressed buffer)");
+    pthread_t maskThread;
+    int maskThreadRunning;
+    u8* maskBuf; // Compressed by the mask thread
+    int maskFailed;
+} ImageWriter;
 
-        LOG_OK;
+void ImageWriterJoinMask(ImageWriter* writer) {
+    if (writer->maskThreadRunning) {
+        pthread_join(writer->maskThread, NULL);
+        writer->maskThreadRunning = FALSE;
+    }
+}
 
-        printf("Compressing KTX data ..");
+// Removes the output file if ImageWriterFinish didn't complete.
+void ImageWriterFree(ImageWriter* writer) {
+    ImageWriterJoinMask(writer);
 
-        ktxCompressedSize = ZSTD_compress(
-            ktxCompressedBuf, maxCompressedSize,
-            ktxData, ktxSize,
-            RECOMPRESS_LVL
-        );
+    // Its tasks write to levelBuf
+    if (writer->levelChain) {
+        MipChainWait(writer->levelChain);
+        MipChainDestroy(writer->levelChain);
+    }
 
-        if (ZSTD_isError(ktxCompressedSize)) {
-            free(ktxCompressedBuf);
+    if (writer->fp != NULL) {
+        fclose(writer->fp);
+        unlink(writer->path);
+    }
+
+    ZSTD_freeCCtx(writer->ownCctx);
+
+    free(writer->outBuf);
+    free(writer->levelBuf);
+    free(writer->maskBuf);
+    free(writer->autoBuf[0]);
+    free(writer->autoBuf[1]);
+    free(writer);
+}
+
+// Feeds src to zstd and writes whatever compressed output is ready. With
+// ZSTD_e_end the frame is finished and flushed. Returns the bytes written.
+u64 ImageWriterCompress(ImageWriter* writer, const void* src, u64 size, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = { .src = src, .size = size, .pos = 0 };
+    u64 written = 0;
+
+    while (TRUE) {
+        ZSTD_outBuffer output = { .dst = writer->outBuf, .size = writer->outBufSize, .pos = 0 };
+
+        u64 remaining = ZSTD_compressStream2(writer->cctx, &output, &input, mode);
+        if (ZSTD_isError(remaining))
             panic("ZSTD compress failed");
+
+        if (output.pos != 0 && fwrite(writer->outBuf, 1, output.pos, writer->fp) != output.pos)
+            panic("The output image binary could not be written.");
+
+        written += output.pos;
+
+        if (mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size)
+            break;
+    }
+
+    return written;
+}
+
+// ktxSize must be exactly the number of KTX bytes that will be fed.
+// cctx and params are optional
+// Must be freed after creation
+ImageWriter* ImageWriterCreate(const char* path, ZSTD_CCtx* cctx, const ImageCompressParams* params, u16 width, u16 height, u64 ktxSize) {
+    if (ktxSize > UINT_MAX)
+        panic("The KTX data is too large for an image binary.");
+
+    ImageWriter* writer = (ImageWriter*)calloc(1, sizeof(ImageWriter));
+    if (writer == NULL)
+        panic("Failed to allocate memory (image writer)");
+
+    snprintf(writer->path, sizeof(writer->path), "%s", path);
+
+    if (params != NULL)
+        writer->params = *params;
+    else
+        writer->params = (ImageCompressParams)IMAGE_COMPRESS_PARAMS_DEFAULT;
+
+    writer->chosen = writer->params;
+
+    writer->width = width;
+    writer->height = height;
+    writer->ktxSize = ktxSize;
+
+    writer->cctx = cctx;
+    if (cctx == NULL)
+        writer->cctx = writer->ownCctx = ZSTD_createCCtx();
+
+    writer->outBufSize = ZSTD_CStreamOutSize();
+    writer->outBuf = (u8*)malloc(writer->outBufSize);
+
+    if (writer->cctx == NULL || writer->outBuf == NULL) {
+        ImageWriterFree(writer);
+        panic("Failed to allocate memory (image writer)");
+    }
+
+    writer->fp = fopen(path, "wb");
+    if (writer->fp == NULL) {
+        ImageWriterFree(writer);
+        panic("The output image binary could not be opened for writing. Does the directory exist?");
+    }
+
+    // Reserved, filled in by ImageWriterFinish
+    ImageFileHeader placeholder = { 0 };
+    if (fwrite(&placeholder, 1, sizeof(placeholder), writer->fp) != sizeof(placeholder)) {
+        ImageWriterFree(writer);
+        panic("The output image binary could not be written.");
+    }
+
+    if (!ImageCompressParamsApply(writer->cctx, &writer->params)) {
+        ImageWriterFree(writer);
+        panic("The zstd compression settings were rejected.");
+    }
+
+    // Stored in the frame header, same as a one-shot compress
+    ZSTD_CCtx_setPledgedSrcSize(writer->cctx, ktxSize);
+
+    return writer;
+}
+
+void* ImageWriterMaskMain(void* arg) {
+    ImageWriter* writer = (ImageWriter*)arg;
+
+    u64 maskSize = (u64)writer->maskWidth * writer->maskHeight;
+    u64 bound = ZSTD_compressBound(maskSize);
+
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    writer->maskBuf = (u8*)malloc(bound);
+
+    if (cctx == NULL || writer->maskBuf == NULL)
+        writer->maskFailed = TRUE;
+    else {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, writer->params.level);
+
+        u64 compressedSize = ZSTD_compress2(cctx, writer->maskBuf, bound, writer->maskData, maskSize);
+        if (ZSTD_isError(compressedSize))
+            writer->maskFailed = TRUE;
+        else
+            writer->maskCompressedSize = compressedSize;
+    }
+
+    ZSTD_freeCCtx(cctx);
+
+    return NULL;
+}
+
+// The mask (optional) must stay valid until ImageWriterFinish. With zstd
+// worker threads enabled its compression starts right away.
+void ImageWriterSetMask(ImageWriter* writer, u8* maskData, u16 maskWidth, u16 maskHeight) {
+    writer->maskData = maskData;
+    writer->maskWidth = maskWidth;
+    writer->maskHeight = maskHeight;
+
+    if (maskData == NULL || writer->params.workers <= 0)
+        return;
+
+    if (pthread_create(&writer->maskThread, NULL, ImageWriterMaskMain, writer) != 0)
+        return; // Compressed by ImageWriterFinish instead
+
+    writer->maskThreadRunning = TRUE;
+}
+
+// Keeps an already compressed mask frame (of a maskWidth x maskHeight mask)
+// as is. It must stay valid until ImageWriterFinish.
+void ImageWriterSetCompressedMask(ImageWriter* writer, const u8* frame, u32 frameSize, u16 maskWidth, u16 maskHeight) {
+    writer->maskFrame = frame;
+    writer->maskCompressedSize = frameSize;
+    writer->maskWidth = maskWidth;
+    writer->maskHeight = maskHeight;
+}
+
+void ImageWriterWriteKTX(ImageWriter* writer, const void* data, u64 size) {
+    writer->ktxCompressedSize += ImageWriterCompress(writer, data, size, ZSTD_e_continue);
+}
+
+// Feeds the KTX data KTXCreate would make for RGBA8 imageData, generating one
+// level at a time. Besides the source image only the largest generated level
+// (a quarter of levelzero) is held.
+// With a pool (which may be NULL), the levels are built on it while
+// levelzero is compressed, and each is compressed as soon as it is done.
+// That holds every generated level at once (a third of levelzero).
+void ImageWriterGenerateKTX(ImageWriter* writer, u8* imageData, ThreadPool* pool) {
+    u16 imageWidth = writer->width;
+    u16 imageHeight = writer->height;
+
+    u32 mipCount = KTXGetCreateMipCount(imageWidth, imageHeight);
+
+    KTXHeader ktxHeader;
+    KTXInitHeader(&ktxHeader, imageWidth, imageHeight);
+
+    u8* levels[KTX_MAX_LEVELS];
+    levels[0] = imageData;
+
+    if (pool && mipCount > 1) {
+        u64 levelsSize = 0;
+        for (unsigned i = 1; i < mipCount; i++)
+            levelsSize += KTXGetCreateLevelSize(imageWidth, imageHeight, i);
+
+        writer->levelBuf = (u8*)malloc(levelsSize ? levelsSize : 1);
+        if (writer->levelBuf == NULL)
+            panic("Failed to allocate memory (KTX level buffer)");
+
+        u8* ptr = writer->levelBuf;
+        for (unsigned i = 1; i < mipCount; i++) {
+            levels[i] = ptr;
+            ptr += KTXGetCreateLevelSize(imageWidth, imageHeight, i);
         }
 
-        LOG_OK;
+        writer->levelChain = MipChainCreate(levels, mipCount, imageWidth, imageHeight);
+        MipChainStart(writer->levelChain, pool, NULL, NULL, 0);
     }
 
-    if (maskData) {
-        u64 maxCompressedSize = ZSTD_compressBound(maskWidth * maskHeight);
+    ImageWriterWriteKTX(writer, &ktxHeader, sizeof(KTXHeader));
+
+    for (unsigned i = 0; i < mipCount; i++) {
+        u32 levelSize = KTXGetCreateLevelSize(imageWidth, imageHeight, i);
+
+        logMsg(INDENT_SPACE "- Compressing level no. %u (size : %u) ..", i+1, levelSize);
 
-        printf("Alloc mask compress buffer (size : %lu) ..", maxCompressedSize);
-        maskCompressedBuf = (u8*)malloc(maxCompressedSize);
-        if (maskCompressedBuf == NULL)
-            panic("Failed to allocate memory (mask compressed buffer)");
+        ImageWriterWriteKTX(writer, &levelSize, sizeof(levelSize));
+
+        // Levelzero is the source itself
+        if (i == 0) {
+            ImageWriterWriteKTX(writer, imageData, levelSize);
+
+            LOG_OK;
+            continue;
+        }
+
+        if (writer->levelChain) {
+            MipChainWaitLevel(writer->levelChain, i);
+            ImageWriterWriteKTX(writer, levels[i], levelSize);
+
+            LOG_OK;
+            continue;
+        }
+
+        // Level 1 comes from the source. Levels only shrink, so every later
+        // one is reduced in place from the one before it.
+        if (writer->levelBuf == NULL) {
+            writer->levelBuf = (u8*)malloc(levelSize ? levelSize : 1);
+            if (writer->levelBuf == NULL)
+                panic("Failed to allocate memory (KTX level buffer)");
+
+            MipReduce(writer->levelBuf, imageData, imageWidth, imageHeight);
+        }
+        else
+            MipReduce(writer->levelBuf, writer->levelBuf, imageWidth >> (i - 1), imageHeight >> (i - 1));
+
+        ImageWriterWriteKTX(writer, writer->levelBuf, levelSize);
 
         LOG_OK;
+    }
+}
 
-        printf("Compressing mask data ..");
+// Instead of feeding the KTX data, writes an already compressed KTX frame as
+// is. Nothing else may be fed.
+void ImageWriterWriteCompressedKTX(ImageWriter* writer, const u8* frame, u64 frameSize) {
+    if (fwrite(frame, 1, frameSize, writer->fp) != frameSize)
+        panic("The output image binary could not be written.");
 
-        maskCompressedSize = ZSTD_compress(
-            maskCompressedBuf, maxCompressedSize,
-            maskData, maskWidth * maskHeight,
-            RECOMPRESS_LVL
-        );
+    writer->ktxCompressedSize = frameSize;
+    writer->ktxPrecompressed = TRUE;
+}
+
+// Instead of feeding the KTX data, compresses all of it with each of
+// imageAutoCandidates and writes the smallest output that took at most
+// params.autoBudgetMs. Candidates are tried cheapest first and the search
+// stops at the first one over budget, so the cheapest is kept if none fit.
+// The mask still uses params.level.
+void ImageWriterWriteKTXAuto(ImageWriter* writer, u8* ktxData, u32 ktxSize) {
+    u64 bound = ZSTD_compressBound(ktxSize);
 
-        if (ZSTD_isError(maskCompressedSize)) {
-            free(maskCompressedBuf);
+    writer->autoBuf[0] = (u8*)malloc(bound);
+    writer->autoBuf[1] = (u8*)malloc(bound);
+    if (writer->autoBuf[0] == NULL || writer->autoBuf[1] == NULL)
+        panic("Failed to allocate memory (auto compress buffers)");
+
+    int bestSlot = -1;
+    int slot = 0;
+
+    for (unsigned i = 0; i < sizeof(imageAutoCandidates) / sizeof(imageAutoCandidates[0]); i++) {
+        ImageCompressParams trial = writer->params;
+        trial.level = imageAutoCandidates[i].level;
+        trial.windowLog = imageAutoCandidates[i].windowLog;
+
+        char description[64];
+        ImageCompressParamsDescribe(&trial, description, sizeof(description));
+
+        logMsg(INDENT_SPACE "- Trying %s ..", description);
+
+        if (!ImageCompressParamsApply(writer->cctx, &trial))
+            panic("The zstd compression settings were rejected.");
+
+        double start = getTimeMs();
+        u64 size = ZSTD_compress2(writer->cctx, writer->autoBuf[slot], bound, ktxData, ktxSize);
+        double ms = getTimeMs() - start;
+
+        if (ZSTD_isError(size))
             panic("ZSTD compress failed");
+
+        int fits = ms <= writer->params.autoBudgetMs;
+
+        logMsg(" %lu bytes in %.0f ms%s\n", size, ms, fits ? "" : " (over budget)");
+
+        if (bestSlot < 0 || (fits && size < writer->autoSize)) {
+            bestSlot = slot;
+            slot = 1 - slot;
+
+            writer->chosen = trial;
+            writer->autoSize = size;
+            writer->autoMs = ms;
         }
 
+        if (!fits)
+            break;
+    }
+
+    ImageWriterWriteCompressedKTX(writer, writer->autoBuf[bestSlot], writer->autoSize);
+
+    free(writer->autoBuf[0]);
+    free(writer->autoBuf[1]);
+    writer->autoBuf[0] = writer->autoBuf[1] = NULL;
+
+    // Back to the requested settings for the mask
+    if (!ImageCompressParamsApply(writer->cctx, &writer->params))
+        panic("The zstd compression settings were rejected.");
+}
+
+// What ImageWriterWriteKTXAuto picked, e.g. "level=19 long=27, ratio 3.41, 812 ms"
+void ImageWriterDescribeAuto(ImageWriter* writer, char* dst, u32 size) {
+    char description[64];
+    ImageCompressParamsDescribe(&writer->chosen, description, sizeof(description));
+
+    snprintf(
+        dst, size, "%s, ratio %.2f, %.0f ms",
+        description, writer->autoSize ? (double)writer->ktxSize / writer->autoSize : 0.0, writer->autoMs
+    );
+}
+
+// Ends the KTX frame, writes the mask (if set) as a frame of its own and
+// fills in the header. Returns the file size.
+u64 ImageWriterFinish(ImageWriter* writer) {
+    if (!writer->ktxPrecompressed)
+        writer->ktxCompressedSize += ImageWriterCompress(writer, NULL, 0, ZSTD_e_end);
+
+    u8* maskData = writer->maskData;
+    u16 maskWidth = writer->maskWidth;
+    u16 maskHeight = writer->maskHeight;
+
+    int hasMask = maskData != NULL || writer->maskFrame != NULL;
+
+    if (writer->maskThreadRunning) {
+        logMsg("Writing mask data ..");
+
+        ImageWriterJoinMask(writer);
+
+        if (writer->maskFailed)
+            panic("ZSTD compress failed (mask)");
+
+        if (fwrite(writer->maskBuf, 1, writer->maskCompressedSize, writer->fp) != writer->maskCompressedSize)
+            panic("The output image binary could not be written.");
+
         LOG_OK;
     }
+    else if (maskData) {
+        logMsg("Compressing mask data ..");
+
+        ZSTD_CCtx_reset(writer->cctx, ZSTD_reset_session_only);
+        ZSTD_CCtx_setPledgedSrcSize(writer->cctx, (u64)maskWidth * maskHeight);
+
+        writer->maskCompressedSize = ImageWriterCompress(writer, maskData, (u64)maskWidth * maskHeight, ZSTD_e_end);
+
+        LOG_OK;
+    }
+    else if (writer->maskFrame) {
+        logMsg("Copying mask data ..");
+
+        if (fwrite(writer->maskFrame, 1, writer->maskCompressedSize, writer->fp) != writer->maskCompressedSize)
+            panic("The output image binary could not be written.");
+
+        LOG_OK;
+    }
+
+    if (writer->ktxCompressedSize > UINT_MAX || writer->maskCompressedSize > UINT_MAX)
+        panic("The compressed data is too large for an image binary.");
+
+    ImageFileHeader fileHeader;
+
+    fileHeader.magic = IMAGE_MAGIC;
+
+    fileHeader.version = IMAGE_VERSION;
+
+    fileHeader.compressedDataSize = writer->ktxCompressedSize;
+    fileHeader.decompressedDataSize = writer->ktxSize;
+
+    fileHeader.width = writer->width;
+    fileHeader._width = writer->width;
+    fileHeader.height = writer->height;
+    fileHeader._height = writer->height;
 
-    u64 fullSize = sizeof(ImageFileHeader) + ktxCompressedSize + maskCompressedSize;
+    fileHeader.maskWidth = hasMask ? maskWidth : 0;
+    fileHeader.maskHeight = hasMask ? maskHeight : 0;
+    fileHeader.maskCompressedDataSize = writer->maskCompressedSize;
+    fileHeader.maskDecompressedDataSize = hasMask ? maskWidth * maskHeight : 0;
 
-    printf("Alloc image binary buffer (size : %lu) ..", fullSize);
+    logMsg("Writing image header ..");
 
-    u8* imageData = (u8*)malloc(fullSize);
-    if (imageData == NULL)
-        panic("Failed to allocate memory (image binary buffer)");
+    if (
+        fseek(writer->fp, 0, SEEK_SET) != 0 ||
+        fwrite(&fileHeader, 1, sizeof(fileHeader), writer->fp) != sizeof(fileHeader)
+    )
+        panic("The output image binary could not be written.");
+
+    FILE* fp = writer->fp;
+    writer->fp = NULL;
+
+    if (fclose(fp) != 0) {
+        unlink(writer->path);
+        panic("The output image binary could not be written.");
+    }
 
     LOG_OK;
 
-    ImageFileHeader* fileHeader = (ImageFileHeader*)imageData;
+    return sizeof(ImageFileHeader) + writer->ktxCompressedSize + writer->maskCompressedSize;
+}
+
+// Replaces level mipIndex of RGBA8 KTX data with a width x height RGBA8
+// image, which must match the level's dimensions. With regenerate the
+// smaller levels are rebuilt from it the way KTXCreate builds them, each
+// from the one before; the larger ones are never touched.
+void KTXReplaceLevel(const KTXView* view, u32 mipIndex, u8* imageData, int width, int height, int regenerate) {
+    if (KTXGetGLFormat(view->data) != GL_RGBA8_EXT)
+        panic("Only RGBA8 textures can have a level replaced.");
 
-    printf("Copying compressed data ..");
+    KTXLevel* level = KTXGetLevel(view, mipIndex);
 
-    memcpy(fileHeader->headerEnd, ktxCompressedBuf, ktxCompressedSize);
-    free(ktxCompressedBuf);
+    if (level == NULL || view->levels[mipIndex].width == 0)
+        panic("The texture does not store that level.");
 
-    if (maskCompressedBuf) {
-        memcpy(
-            fileHeader->headerEnd + ktxCompressedSize,
-            maskCompressedBuf, maskCompressedSize
+    int mipWidth = view->levels[mipIndex].width;
+    int mipHeight = view->levels[mipIndex].height;
+
+    if (mipWidth != width || mipHeight != height) {
+        char message[128];
+        snprintf(
+            message, sizeof(message), "The level image is %dx%d but the level is %dx%d.",
+            width, height, mipWidth, mipHeight
         );
-        free(maskCompressedBuf);
+        panic(message);
     }
 
-    LOG_OK;
+    if (level->imageSize != (u32)width * height * 4)
+        panic("The stored level size doesn't match its dimensions.");
 
-    fileHeader->magic = IMAGE_MAGIC;
+    memcpy(level->data, imageData, level->imageSize);
 
-    fileHeader->version = IMAGE_VERSION;
+    if (!regenerate)
+        return;
 
-    fileHeader->compressedDataSize = ktxCompressedSize;
-    fileHeader->decompressedDataSize = ktxSize;
+    for (u32 i = mipIndex + 1; i < view->levelCount; i++) {
+        KTXLevel* smaller = KTXGetLevel(view, i);
 
-    KTXHeader* ktxHeader = (KTXHeader*)ktxData;
+        mipWidth = view->levels[i].width;
+        mipHeight = view->levels[i].height;
+        if (mipWidth == 0)
+            break;
+
+        if (smaller->imageSize != (u32)mipWidth * mipHeight * 4)
+            panic("The stored level size doesn't match its dimensions.");
 
-    fileHeader->width = ktxHeader->pixelWidth;
-    fileHeader->_width = ktxHeader->pixelWidth;
-    fileHeader->height = ktxHeader->pixelHeight;
-    fileHeader->_height = ktxHeader->pixelHeight;
+        logMsg(INDENT_SPACE "- Regenerating level no. %u ..", i+1);
 
-    fileHeader->maskWidth = maskWidth;
-    fileHeader->maskHeight = maskHeight;
-    fileHeader->maskCompressedDataSize = maskCompressedSize;
-    fileHeader->maskDecompressedDataSize = maskWidth * maskHeight;
+        const KTXLevelInfo* larger = &view->levels[i - 1];
+        MipReduce(smaller->data, KTXGetLevel(view, i - 1)->data, larger->width, larger->height);
 
-    if (imageSizeOut != NULL)
-        *imageSizeOut = fullSize;
+        LOG_OK;
+    }
+}
 
-    return imageData;
+// Encodes 8-bit pixels to path in the format named by fileExtension (PNG by
+// default). Returns 0 on failure.
+int ImageEncodePixels(const char* path, const char* fileExtension, int width, int height, u32 comp, const u8* pixels) {
+    if (strcmp(fileExtension, "bmp") == 0)
+        return stbi_write_bmp(path, width, height, comp, pixels);
+    if (strcmp(fileExtension, "jpg") == 0)
+        return stbi_write_jpg(path, width, height, comp, pixels, JPEG_QUALITY_LVL);
+    if (strcmp(fileExtension, "tga") == 0)
+        return stbi_write_tga(path, width, height, comp, pixels);
+
+    // Default is PNG
+    return stbi_write_png(path, width, height, comp, pixels, comp * width);
 }
 
-void ImageExportTexture(u8* imageData, char* outputPath) {
-    u8* ktxData = ImageCreateKTXData(imageData);
+// Writes width x height pixels of KTX data in the given format to path,
+// converting them first if the format isn't written out as stored.
+void ImageWritePixels(const char* path, const char* fileExtension, int width, int height, const KTXFormat* format, const u8* pixels) {
+    u8* converted = NULL;
 
-    printf("Writing images: \n");
+    if (format->convertKernels) {
+        converted = (u8*)malloc((u64)width * height * format->outputComp);
+        if (converted == NULL)
+            panic("Failed to allocate memory (converted pixels)");
 
+        KTXConvertPixels(format, converted, pixels, (u32)width * height);
+        pixels = converted;
+    }
+
+    int writeResult = ImageEncodePixels(path, fileExtension, width, height, format->outputComp, pixels);
+
+    free(converted);
+
+    if (writeResult == 0)
+        panic("The output image could not be created.");
+}
+
+// Writes one level (levelSize bytes at levelData) next to outputPath. The
+// path is copied to fnOut (PATH_MAX). Returns FALSE if the level was skipped.
+// Only reads its arguments, so levels may be written concurrently.
+int ImageWriteLevel(KTXHeader* ktxHeader, u32 mipIndex, u8* levelData, u32 levelSize, char* outputPath, char* fnOut) {
     char* fileExtension = getFileExtension(outputPath);
-    u32* imageSize = KTXGetImageSize(ktxData);
-    u32 pixelComp = KTXGetPixelComp(ktxData);
+    const KTXFormat* format = KTXGetFormat((u8*)ktxHeader);
+
+    snprintf(
+        fnOut, PATH_MAX, "%.*s.mip%u.%s",
 
-    for (unsigned i = 0; i < KTXGetLevelCount(ktxData); i++) {
-        KTXLevel* level = KTXGetLevel(ktxData, i);
+        (int)(strlen(outputPath) - strlen(fileExtension) - 1),
+        outputPath,
 
-        char fn[128];
-        sprintf(
-            fn, "%.*s.mip%u.%s",
+        mipIndex+1,
+        fileExtension
+    );
 
-            (int)(strlen(outputPath) - strlen(fileExtension) - 1),
-            outputPath,
+    logMsg(INDENT_SPACE "- Writing level no. %u to path '%s'..", mipIndex+1, fnOut);
 
-            i+1,
-            fileExtension
-        );
+    int mipWidth, mipHeight;
+    if (!KTXGetMipSize(ktxHeader, mipIndex, &mipWidth, &mipHeight)) {
+        logMsg(" Skipped (too small)\n");
+        return FALSE;
+    }
+
+    if ((u64)mipWidth * mipHeight * format->pixelSize > levelSize)
+        panic("KTX level is smaller than its dimensions");
 
-        printf(INDENT_SPACE "- Writing level no. %u to path '%s'..", i+1, fn);
+    ImageWritePixels(fnOut, fileExtension, mipWidth, mipHeight, format, levelData);
 
-        int mipWidth = imageSize[0] / pow(2, i);
-        int mipHeight = imageSize[1] / pow(2, i);
+    LOG_OK;
+
+    return TRUE;
+}
 
-        if (mipWidth <= 0 || mipHeight <= 0) {
-            printf(" Skipped (too small)\n");
+// Writes level mipIndex of decoded KTX data next to outputPath. The path is
+// copied to fnOut (PATH_MAX). Returns FALSE if the level was skipped.
+// The view is only read, so levels may be written concurrently.
+int ImageExportLevel(const KTXView* view, u32 mipIndex, char* outputPath, char* fnOut) {
+    KTXLevel* level = KTXGetLevel(view, mipIndex);
+
+    // The last level of a KTXCreate file is counted but not stored
+    if (level == NULL)
+        return ImageWriteLevel((KTXHeader*)view->data, mipIndex, NULL, 0, outputPath, fnOut);
+
+    return ImageWriteLevel((KTXHeader*)view->data, mipIndex, level->data, level->imageSize, outputPath, fnOut);
+}
+
+// Decompresses and writes the mask of imageData next to outputPath. The path
+// is copied to fnOut (PATH_MAX). Returns FALSE if there is no mask.
+int ImageExportMask(u8* imageData, char* outputPath, char* fnOut) {
+    if (!ImageGetMaskExists(imageData))
+        return FALSE;
+
+    char* fileExtension = getFileExtension(outputPath);
+
+    u8* maskData = ImageCreateMaskData(imageData);
+    u16* maskSize = ImageGetMaskSize(imageData);
+
+    snprintf(
+        fnOut, PATH_MAX, "%.*s.mask.png",
+
+        (int)(strlen(outputPath) - strlen(fileExtension) - 1),
+        outputPath
+    );
+
+    logMsg("Writing mask data to path '%s'..", fnOut);
+
+    int writeResult = stbi_write_png(
+        fnOut,
+        maskSize[0], maskSize[1],
+        1, maskData,
+        1 * maskSize[0]
+    );
+
+    free(maskData);
+
+    if (writeResult == 0)
+        panic("The mask data could not be exported.");
+
+    LOG_OK;
+
+    return TRUE;
+}
+
+// Writes the selected levels of already decoded KTX data (plus the mask from
+// imageData). The view is only read, so it may be shared between threads.
+// Every written path is added to writtenOut if one is passed.
+// select is optional
+void ImageExportKTX(u8* imageData, const KTXView* view, const ImageSelect* select, char* outputPath, PathList* writtenOut) {
+    logMsg("Writing images: \n");
+
+    char fn[PATH_MAX];
+
+    u32 wanted = select ? ImageSelectLevels(select, (KTXHeader*)view->data) : 0xFFFFFFFF;
+
+    for (unsigned i = 0; i < KTXGetLevelCount(view->data); i++) {
+        if ((wanted & (1u << i)) == 0)
             continue;
-        }
 
-        int writeResult = 0;
-
-        if (strcmp(fileExtension, "bmp") == 0) {
-            writeResult = stbi_write_bmp(
-                fn,
-                mipWidth, mipHeight,
-                pixelComp, level->data
-            );
-        } else if (strcmp(fileExtension, "jpg") == 0) {
-            writeResult = stbi_write_jpg(
-                fn,
-                mipWidth, mipHeight,
-                pixelComp, level->data,
-                JPEG_QUALITY_LVL
-            );
-        } else if (strcmp(fileExtension, "tga") == 0) {
-            writeResult = stbi_write_tga(
-                fn,
-                mipWidth, mipHeight,
-                pixelComp, level->data
-            );
-        } else { // Default is PNG
-            writeResult = stbi_write_png(
-                fn,
-                mipWidth, mipHeight,
-                pixelComp, level->data,
-                4 * mipWidth
-            );
-        }
+        if (ImageExportLevel(view, i, outputPath, fn) && writtenOut != NULL)
+            PathListAdd(writtenOut, fn);
+    }
 
-        if (writeResult == 0)
-            panic("The output image could not be created.");
+    if ((select == NULL || select->mask) && ImageExportMask(imageData, outputPath, fn) && writtenOut != NULL)
+        PathListAdd(writtenOut, fn);
 
-        LOG_OK;
+    logMsg("Extraction finished.\n");
+}
+
+typedef struct {
+    char* outputPath;
+    PathList* writtenOut;
+} ImageExportContext;
+
+void ImageExportStreamedLevel(KTXHeader* ktxHeader, u32 mipIndex, u8* levelData, u32 levelSize, void* userData) {
+    ImageExportContext* ctx = (ImageExportContext*)userData;
+
+    char fn[PATH_MAX];
+    int written = ImageWriteLevel(ktxHeader, mipIndex, levelData, levelSize, ctx->outputPath, fn);
+
+    free(levelData);
+
+    if (written && ctx->writtenOut != NULL)
+        PathListAdd(ctx->writtenOut, fn);
+}
+
+// Writes the width x height rectangle at (x, y) of levelzero to outputPath
+// itself. Rows are decompressed in order and only the cropped part of each
+// is kept; decompression stops after the last row of the rectangle.
+void ImageExportRegion(u8* imageData, u32 x, u32 y, u32 width, u32 height, char* outputPath) {
+    ImageCheckHeader(imageData);
+
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (dctx == NULL)
+        panic("Failed to create ZSTD decompression context");
+
+    KTXStream stream;
+    KTXHeader ktxHeader;
+
+    int bigEndian = KTXStreamBegin(&stream, imageData, dctx, &ktxHeader);
+
+    if (
+        width == 0 || height == 0 ||
+        (u64)x + width > ktxHeader.pixelWidth || (u64)y + height > ktxHeader.pixelHeight
+    ) {
+        ZSTD_freeDCtx(dctx);
+        panic("The region lies outside of the texture.");
     }
 
-    if (ImageGetMaskExists(imageData)) {
-        u8* maskData = ImageCreateMaskData(imageData);
-        u16* maskSize = ImageGetMaskSize(imageData);
+    const KTXFormat* format = KTXGetFormat((u8*)&ktxHeader);
+    u32 pixelSize = format->pixelSize;
+    u64 rowSize = (u64)ktxHeader.pixelWidth * pixelSize;
 
-        char fn[128];
-        sprintf(
-            fn, "%.*s.mask.png",
+    u32 levelSize;
+    int status = KTXStreamRead(&stream, &levelSize, sizeof(levelSize), NULL);
+    if (status != KTX_STREAM_OK)
+        panic(status == KTX_STREAM_ERROR ? "Decompression error" : "KTX data is truncated");
 
-            (int)(strlen(outputPath) - strlen(fileExtension) - 1),
-            outputPath
-        );
+    if (bigEndian)
+        levelSize = __builtin_bswap32(levelSize);
 
+    if (rowSize * ktxHeader.pixelHeight > levelSize)
+        panic("KTX level is smaller than its dimensions");
 
-        printf("Writing mask data to path '%s'..", fn);
+    u32 cropRowSize = width * pixelSize;
 
-        int writeResult = stbi_write_png(
-            fn,
-            maskSize[0], maskSize[1],
-            1, maskData,
-            1 * maskSize[0]
-        );
-        
-        if (writeResult == 0)
-            panic("The mask data could not be exported.");
+    u8* pixels = (u8*)malloc((u64)cropRowSize * height);
+    if (pixels == NULL)
+        panic("Failed to allocate memory (region buffer)");
 
-        LOG_OK;
+    logMsg("Decompressing & writing region %u,%u %ux%u to path '%s'..", x, y, width, height, outputPath);
+
+    KTXStreamSkip(&stream, rowSize * y);
+
+    for (u32 row = 0; row < height; row++) {
+        KTXStreamSkip(&stream, (u64)x * pixelSize);
+
+        status = KTXStreamRead(&stream, pixels + (u64)row * cropRowSize, cropRowSize, NULL);
+        if (status != KTX_STREAM_OK) {
+            free(pixels);
+            panic(status == KTX_STREAM_ERROR ? "Decompression error" : "KTX data is truncated");
+        }
+
+        // Nothing after the last row is needed
+        if (row + 1 < height)
+            KTXStreamSkip(&stream, rowSize - (u64)(x + width) * pixelSize);
     }
 
-    printf("Extraction finished.\n");
+    ZSTD_freeDCtx(dctx);
+
+    ImageWritePixels(outputPath, getFileExtension(outputPath), width, height, format, pixels);
+
+    free(pixels);
+
+    LOG_OK;
+}
+
+// Each level is written as soon as it has been decompressed, so only one
+// level is in memory at a time.
+// select and writtenOut are optional
+void ImageExportTexture(u8* imageData, const ImageSelect* select, char* outputPath, PathList* writtenOut) {
+    ImageExportContext ctx = { .outputPath = outputPath, .writtenOut = writtenOut };
+
+    logMsg("Decompressing & writing images: \n");
+
+    ImageStreamKTX(imageData, NULL, select, ImageExportStreamedLevel, &ctx);
+
+    char fn[PATH_MAX];
+    if ((select == NULL || select->mask) && ImageExportMask(imageData, outputPath, fn) && writtenOut != NULL)
+        PathListAdd(writtenOut, fn);
 
-    free(ktxData);
+    logMsg("Extraction finished.\n");
 }
 
 #endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imageProcess.h"
+
+// Checks every CPU level this machine supports against the scalar kernels
+// (make test). Vector kernels do whole steps and leave the rest to scalar
+// code, so sizes cover odd widths and heights (the 3-wide last column and
+// row) and every start offset up to a few vector steps.
+
+int failures = 0;
+
+void fail(const char* what, int level, u32 a, u32 b) {
+    printf("FAIL: %s at %s (%u, %u)\n", what, cpuLevelNames[level], a, b);
+    failures++;
+}
+
+u8* randomBytes(u64 size) {
+    u8* data = (u8*)malloc(size ? size : 1);
+    if (data == NULL)
+        panic("Failed to allocate memory (test data)");
+
+    for (u64 i = 0; i < size; i++)
+        data[i] = (u8)rand();
+
+    return data;
+}
+
+// MipReduce of every size up to 70 x 7 against the scalar level's result
+void testMipReduce(int level) {
+    for (u32 height = 1; height <= 7; height++) {
+        for (u32 width = 1; width <= 70; width++) {
+            u8* src = randomBytes((u64)width * height * 4);
+            u8* expected = randomBytes((u64)(width / 2) * (height / 2) * 4);
+            u8* actual = randomBytes((u64)(width / 2) * (height / 2) * 4);
+
+            cpuLevel = CPU_SCALAR;
+            MipReduce(expected, src, width, height);
+
+            cpuLevel = level;
+            MipReduce(actual, src, width, height);
+
+            if (memcmp(expected, actual, (u64)(width / 2) * (height / 2) * 4) != 0)
+                fail("MipReduce", level, width, height);
+
+            free(src);
+            free(expected);
+            free(actual);
+        }
+    }
+}
+
+// The row kernel from every start offset, the tail finished in scalar code
+void testMipRow(int level) {
+    const u32 pixelCount = 100;
+
+    u8* r0 = randomBytes(pixelCount * 8);
+    u8* r1 = randomBytes(pixelCount * 8);
+    u8* expected = randomBytes(pixelCount * 4);
+    u8* actual = randomBytes(pixelCount * 4);
+
+    MipRowScalar(expected, r0, r1, 0, pixelCount);
+
+    for (u32 start = 0; start < 40; start++) {
+        for (u32 count = 0; start + count <= pixelCount; count += 7) {
+            memset(actual, 0, pixelCount * 4);
+
+            u32 done = mipRowKernels[level](actual, r0, r1, start, count);
+            if (done > count) {
+                fail("MipRow (overrun)", level, start, count);
+                continue;
+            }
+
+            MipRowScalar(actual, r0, r1, start + done, count - done);
+
+            if (memcmp(expected + start * 4, actual + start * 4, count * 4) != 0)
+                fail("MipRow", level, start, count);
+        }
+    }
+
+    free(r0);
+    free(r1);
+    free(expected);
+    free(actual);
+}
+
+// Every 16-bit value, from every start offset
+void testConvertRGBA16(int level) {
+    const u32 pixelCount = 65536 / 4 + 40;
+
+    u8* src = randomBytes(pixelCount * 8);
+    u8* expected = randomBytes(pixelCount * 4);
+    u8* actual = randomBytes(pixelCount * 4);
+
+    for (u32 value = 0; value < 65536; value++) {
+        src[value * 2] = value & 0xFF;
+        src[value * 2 + 1] = value >> 8;
+    }
+
+    KTXConvertRGBA16Scalar(expected, src, 0, pixelCount);
+
+    for (u32 value = 0; value < 65536; value++) {
+        if (expected[value] != (value * 255 + 32767) / 65535) {
+            fail("KTXConvertRGBA16Scalar", CPU_SCALAR, value, 0);
+            break;
+        }
+    }
+
+    for (u32 start = 0; start < 40; start++) {
+        memset(actual, 0, pixelCount * 4);
+
+        u32 count = pixelCount - start;
+        u32 done = ktxConvertRGBA16Kernels[level](actual, src, start, count);
+        KTXConvertRGBA16Scalar(actual, src, start + done, count - done);
+
+        if (memcmp(expected + start * 4, actual + start * 4, count * 4) != 0)
+            fail("KTXConvertRGBA16", level, start, count);
+    }
+
+    free(src);
+    free(expected);
+    free(actual);
+}
+
+int main(void) {
+    int supported = CpuDetect();
+
+    srand(1);
+
+    for (int level = CPU_SCALAR + 1; level <= supported; level++) {
+        printf("Checking %s kernels ..\n", cpuLevelNames[level]);
+
+        testMipReduce(level);
+        testMipRow(level);
+        testConvertRGBA16(level);
+    }
+
+    for (int level = supported + 1; level < CPU_LEVEL_COUNT; level++)
+        printf("Skipping %s kernels (not supported by this CPU)\n", cpuLevelNames[level]);
+
+    if (failures != 0) {
+        printf("%d check(s) failed.\n", failures);
+        return 1;
+    }
+
+    printf("All kernels match scalar.\n");
+    return 0;
+}
@@ -6,52 +6,221 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
 
+#include "batch.h"
+#include "server.h"
+#include "cache.h"
+#include "scan.h"
+#include "cpu.h"
+
 #include "common.h"
 
 void usage(int showTitle) {
     if (showTitle) {
-        printf("Image Tool v1.1\n");
+        printf("Image Tool v" IMAGETOOL_VERSION "\n");
         printf("A utility for extracting and creating texture files for World of Goo 2.\n\n");
     }
 
     printf("Usage:\n");
-    printf("    imagetool -e <input_image_file> -o <output_image_file>\n");
-    printf("    imagetool -c <input_image_file> -o <output_image_file> [-m <mask_image_file>]\n\n");
+    printf("    imagetool -e <input_image_file> -o <output_image_file> [--levels <levels> | --region <x,y,w,h>]\n");
+    printf("    imagetool -e <input_directory> -o <output_directory> [--levels <levels>] [-j <jobs>] [--mem-budget <size>]\n");
+    printf("    imagetool -c <input_image_file> -o <output_image_file> [-m <mask_image_file>] [-j <jobs>] [<compression options>]\n");
+    printf("    imagetool --manifest <manifest_file> [-j <jobs>] [--mem-budget <size>] [<compression options>]\n");
+    printf("    imagetool --replace-mask <image_file> -m <mask_image_file> [-o <output_image_file>]\n");
+    printf("    imagetool --replace-level <n> <level_image_file> <image_file> [--regenerate] [-o <output_image_file>]\n");
+    printf("    imagetool --optimize <image_file|directory> ... [-j <jobs>] [--mem-budget <size>] [<compression options>]\n");
+    printf("    imagetool --serve <socket_path> [-j <jobs>]\n");
+    printf("    imagetool --scan <directory> [--ktx] [--format csv|json] [-o <output_file>]\n");
+    printf("    imagetool --connect <socket_path> (-e | -c) <input_file> -o <output_file> [-m <mask_image_file>] [--levels <levels>]\n\n");
 
     printf("Options:\n");
     printf("    -e, --extract        Extract textures from a .image file.\n");
-    printf("                         <input_image_file>: Path to the .image file.\n");
-    printf("                         <output_image_file>: Path for the extracted image with desired format (.png, .bmp, .tga, .jpg).\n\n");
+    printf("                         <input_image_file>: Path to the .image file, or '-' to read standard input.\n");
+    printf("                         <output_image_file>: Path for the extracted image with desired format (.png, .bmp, .tga, .jpg).\n");
+    printf("                         If a directory is given, every .image file below it is extracted to\n");
+    printf("                         .png files in <output_directory>, mirroring the directory layout.\n");
+    printf("    --levels <levels>    With -e: only extract these mip levels, numbered from 0 (full size, written\n");
+    printf("                         as .mip1). A comma separated list of levels, ranges (2-4), 'last' for the\n");
+    printf("                         smallest level, 'mask' and 'all'. The mask is skipped unless listed.\n");
+    printf("    --region <x,y,w,h>   With -e of a single file: only extract this rectangle of level 0, written\n");
+    printf("                         to <output_image_file> itself. Decompression stops after its last row.\n\n");
 
     printf("    -c, --create         Create a .image file from an input image.\n");
     printf("                         <input_image_file>: Path to the source image (.png, .bmp, .tga, .psd, .jpg).\n");
     printf("                         <output_image_file>: Path for the created .image file.\n\n");
 
-    printf("    -o, --output <path>  Specify the output path (required).\n\n");
+    printf("    --manifest <path>    Create many .image files in parallel from a manifest.\n");
+    printf("                         Each line reads '<input> <mask> <output>'; use '-' for no mask.\n");
+    printf("                         Blank lines and lines starting with '#' are ignored.\n\n");
+
+    printf("    --replace-mask       Swap the mask of an existing .image file for -m <mask_image_file>. The\n");
+    printf("                         texture data is copied as is and only the mask is compressed. Rewrites the\n");
+    printf("                         file in place unless -o is given.\n\n");
+
+    printf("    --replace-level <n> <level_image_file>\n");
+    printf("                         Swap mip level n of an existing .image file (numbered from 0 like\n");
+    printf("                         --levels, 0 is full size and extracts as .mip1) for an image of the same\n");
+    printf("                         dimensions.\n");
+    printf("    --regenerate         With --replace-level: also rebuild the smaller levels from the new one.\n");
+    printf("                         Rewrites the file in place unless -o is given.\n\n");
+
+    printf("    --optimize           Recompress existing .image files in place (default: --level %d) without\n", OPTIMIZE_LVL);
+    printf("                         re-encoding the texture. A file is only replaced if it gets smaller.\n");
+    printf("                         Takes any number of .image files and directories.\n\n");
+
+    printf("    --serve <path>       Stay resident and serve extract/create requests on a Unix socket.\n");
+    printf("                         Recently decoded KTX data is kept in memory between requests.\n");
+    printf("                         Stop the server with SIGINT or SIGTERM.\n\n");
+
+    printf("    --connect <path>     Send an extract or create request to a running server instead of\n");
+    printf("                         doing the work in this process.\n\n");
+
+    printf("    --scan <dir>         List every .image file below a directory with its dimensions, payload\n");
+    printf("                         sizes and mask size, reading only the file headers. Written as CSV\n");
+    printf("                         (or JSON with --format json) to stdout, or to -o <path>.\n");
+    printf("    --ktx                With --scan: also decompress the start of each KTX payload to report\n");
+    printf("                         its mip count and pixel format.\n\n");
+
+    printf("    --cache <dir>        Reuse outputs from a cache directory when the inputs and options are\n");
+    printf("                         unchanged, and store new outputs there. Works with -e, -c and --manifest.\n\n");
+
+    printf("    --shard <i>/<n>      Only process shard i (0 to n-1) of a batch. Files are split by size so\n");
+    printf("                         shards take about as long; running all n shards covers the whole batch.\n\n");
+
+    printf("    --depfile <path>     Write a make-compatible dependency file listing every generated file\n");
+    printf("                         and the inputs (image, mask, manifest) it was built from.\n\n");
+
+    printf("    -o, --output <path>  Specify the output path (required, except with --manifest, --serve and --scan).\n\n");
 
     printf("    -m, --mask <path>    Optional: Specify a mask image when creating a .image file.\n");
     printf("                         Supported formats: .png, .bmp, .tga, .psd, .jpg.\n");
     printf("                         The mask image should use luminance (black = 0, white = 1).\n\n");
 
+    printf("    -j, --jobs <n>       Number of worker threads for batch modes, and for generating the mip\n");
+    printf("                         levels of a single -c (default: CPU count; for -c, only for images\n");
+    printf("                         of 1024x1024 or more).\n\n");
+
+    printf("    --mem-budget <size>  Limit batch modes to files whose estimated peak memory use fits in\n");
+    printf("                         <size> (e.g. 512M, 2G) together. Larger files are started first.\n\n");
+
+    printf("    --level <n>          zstd level for created .image files (default: %d). Higher is smaller but slower.\n", RECOMPRESS_LVL);
+    printf("    --long <window_log>  Enable zstd long-distance matching with a 2^window_log byte window\n");
+    printf("                         (%d to %d).\n", IMAGE_WINDOWLOG_MIN, IMAGE_WINDOWLOG_MAX);
+    printf("    --auto <ms>          Try several levels and windows per texture and keep the smallest output\n");
+    printf("                         that compressed within <ms> milliseconds. The pick is reported per file.\n");
+    printf("                         The mask still uses --level.\n\n");
+
+    printf("    --zstd-threads <n>   Compress created .image files with n zstd worker threads. The output is\n");
+    printf("                         still a single standard frame. The mask is compressed alongside the KTX data.\n");
+    printf("    --zstd-job-size <size>\n");
+    printf("                         Input size of each zstd worker job (e.g. 4M, default: chosen by zstd).\n\n");
+
+    printf("    --cpu <level>        Run pixel kernels at a lower instruction set level than the CPU supports,\n");
+    printf("                         for testing: scalar, sse4.1, avx2 or avx512 (default: the highest\n");
+    printf("                         supported, or the IMAGETOOL_CPU environment variable).\n\n");
+
     printf("    -h, --help           Display this help message and exit.\n\n");
 
     printf("Examples:\n");
     printf("    Extract:           imagetool -e ./sample.image -o ./sample.png\n");
     printf("    Create:            imagetool -c ./sample.png -o ./sample.image\n");
     printf("    Create with mask:  imagetool -c ./sample.png -o ./sample.image -m ./sample_mask.png\n");
+    printf("    Extract a tree:    imagetool -e ./res -o ./res_png -j 8\n");
+    printf("    Thumbnails only:   imagetool -e ./res -o ./res_png --levels last\n");
+    printf("    Batch create:      imagetool --manifest ./textures.txt\n");
+    printf("    Start a server:    imagetool --serve /tmp/imagetool.sock\n");
+    printf("    Use a server:      imagetool --connect /tmp/imagetool.sock -e ./sample.image -o ./sample.png\n");
+    printf("    Catalog a tree:    imagetool --scan ./res --ktx --format json -o ./res.json\n");
     printf("    Show help:         imagetool --help\n");
 
     exit(1);
 }
 
+void writeCreateDepfile(const char* depfilePath, char* inputPath, char* maskPath, char* outputPath) {
+    PathList outputs = { 0 };
+    PathListAdd(&outputs, outputPath);
+
+    const char* inputs[2] = { inputPath, maskPath };
+
+    FILE* fp = DepfileOpen(depfilePath);
+    DepfileWriteRule(fp, &outputs, inputs, 2);
+    DepfileClose(fp);
+
+    PathListFree(&outputs);
+}
+
+// Parses a byte count with an optional K, M or G (binary) suffix. Returns 0 if malformed.
+u64 parseByteSize(const char* str) {
+    char* end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str)
+        return 0;
+
+    switch (tolower(*end)) {
+    case 'g': value <<= 10; // Fallthrough
+    case 'm': value <<= 10; // Fallthrough
+    case 'k': value <<= 10;
+        end++;
+        break;
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+
+    if (*end != '\0')
+        return 0;
+
+    return value;
+}
+
+// Upper bound for -j, well past any core count
+#define MAX_JOB_COUNT 1024
+
 #define COMMAND_BAD     0
 #define COMMAND_EXTRACT 1
 #define COMMAND_CREATE  2
+#define COMMAND_MANIFEST 3
+#define COMMAND_SERVE    4
+#define COMMAND_SCAN     5
+#define COMMAND_OPTIMIZE 6
+#define COMMAND_REPLACE_MASK 7
+#define COMMAND_REPLACE_LEVEL 8
 
 int main(int argc, char* argv[]) {
     char* inputPath = NULL;
     char* outputPath = NULL;
     char* maskPath = NULL;
+    char* connectPath = NULL;
+    char* cacheDir = NULL;
+    char* depfilePath = NULL;
+    char* cpuName = NULL;
+
+    unsigned jobCount = 0;
+
+    u32 shardIndex = 0;
+    u32 shardCount = 1;
+
+    u64 memBudget = 0;
+
+    ImageCompressParams compress = IMAGE_COMPRESS_PARAMS_DEFAULT;
+    int levelSet = FALSE;
+
+    u32 replaceLevel = 0; // Numbered from levelzero, like --levels
+    int replaceLevelSet = FALSE;
+    char* levelImagePath = NULL;
+    int regenerate = FALSE;
+
+    // Every positional argument; --optimize takes several
+    char** inputPaths = (char**)calloc(argc, sizeof(char*));
+    u32 inputPathCount = 0;
+
+    ImageSelect select = IMAGE_SELECT_ALL;
+
+    int regionSet = FALSE;
+    u32 region[4]; // x, y, width, height
+
+    int scanKTX = FALSE;
+    int scanFormat = SCAN_FORMAT_CSV;
     
     unsigned command = COMMAND_BAD;
 
@@ -65,6 +234,200 @@ int main(int argc, char* argv[]) {
             command = COMMAND_EXTRACT;
         else if (strcmp(argv[i], "--create") == 0 || strcmp(argv[i], "-c") == 0)
             command = COMMAND_CREATE;
+        else if (strcmp(argv[i], "--manifest") == 0) {
+            command = COMMAND_MANIFEST;
+
+            if (i+1 < argc)
+                inputPath = argv[++i];
+            else {
+                printf("Error: Missing manifest path after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--serve") == 0) {
+            command = COMMAND_SERVE;
+
+            if (i+1 < argc)
+                inputPath = argv[++i];
+            else {
+                printf("Error: Missing socket path after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--scan") == 0) {
+            command = COMMAND_SCAN;
+
+            if (i+1 < argc)
+                inputPath = argv[++i];
+            else {
+                printf("Error: Missing directory after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--optimize") == 0)
+            command = COMMAND_OPTIMIZE;
+        else if (strcmp(argv[i], "--replace-mask") == 0)
+            command = COMMAND_REPLACE_MASK;
+        else if (strcmp(argv[i], "--replace-level") == 0) {
+            command = COMMAND_REPLACE_LEVEL;
+
+            if (i+2 < argc && sscanf(argv[i+1], "%u", &replaceLevel) == 1 && replaceLevel < KTX_MAX_LEVELS) {
+                replaceLevelSet = TRUE;
+                levelImagePath = argv[i+2];
+                i += 2;
+            }
+            else {
+                printf("Error: Expected a level number (0 for full size) and an image after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--regenerate") == 0)
+            regenerate = TRUE;
+        else if (strcmp(argv[i], "--levels") == 0) {
+            if (i+1 < argc && ImageSelectParse(argv[i+1], &select))
+                i++;
+            else {
+                printf("Error: Expected levels such as '0', 'last', '2-4' or '0,mask' after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--region") == 0) {
+            int consumed = 0;
+            if (
+                i+1 < argc &&
+                sscanf(argv[i+1], "%u,%u,%u,%u%n", &region[0], &region[1], &region[2], &region[3], &consumed) == 4 &&
+                argv[i+1][consumed] == '\0' && region[2] != 0 && region[3] != 0
+            ) {
+                regionSet = TRUE;
+                i++;
+            }
+            else {
+                printf("Error: Expected 'x,y,width,height' after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--ktx") == 0)
+            scanKTX = TRUE;
+        else if (strcmp(argv[i], "--format") == 0) {
+            if (i+1 < argc && strcmp(argv[i+1], "csv") == 0)
+                scanFormat = SCAN_FORMAT_CSV;
+            else if (i+1 < argc && strcmp(argv[i+1], "json") == 0)
+                scanFormat = SCAN_FORMAT_JSON;
+            else {
+                printf("Error: Expected 'csv' or 'json' after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+
+            i++;
+        }
+        else if (strcmp(argv[i], "--connect") == 0) {
+            if (i+1 < argc)
+                connectPath = argv[++i];
+            else {
+                printf("Error: Missing socket path after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--cache") == 0) {
+            if (i+1 < argc)
+                cacheDir = argv[++i];
+            else {
+                printf("Error: Missing cache directory after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--depfile") == 0) {
+            if (i+1 < argc)
+                depfilePath = argv[++i];
+            else {
+                printf("Error: Missing dependency file path after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--cpu") == 0) {
+            if (i+1 < argc && CpuParseLevel(argv[i+1]) >= 0)
+                cpuName = argv[++i];
+            else {
+                printf("Error: Missing or invalid CPU level after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--shard") == 0) {
+            if (i+1 < argc && sscanf(argv[i+1], "%u/%u", &shardIndex, &shardCount) == 2 && shardIndex < shardCount)
+                i++;
+            else {
+                printf("Error: Expected '<index>/<count>' with 0 <= index < count after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--mem-budget") == 0) {
+            if (i+1 < argc && (memBudget = parseByteSize(argv[i+1])) != 0)
+                i++;
+            else {
+                printf("Error: Expected a size such as '512M' or '2G' after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--level") == 0) {
+            if (
+                i+1 < argc &&
+                sscanf(argv[i+1], "%d", &compress.level) == 1 &&
+                compress.level >= ZSTD_minCLevel() && compress.level <= ZSTD_maxCLevel()
+            ) {
+                levelSet = TRUE;
+                i++;
+            }
+            else {
+                printf("Error: Expected a zstd level from %d to %d after '%s'.\n\n", ZSTD_minCLevel(), ZSTD_maxCLevel(), argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--long") == 0) {
+            if (
+                i+1 < argc &&
+                sscanf(argv[i+1], "%d", &compress.windowLog) == 1 &&
+                compress.windowLog >= IMAGE_WINDOWLOG_MIN && compress.windowLog <= IMAGE_WINDOWLOG_MAX
+            )
+                i++;
+            else {
+                printf("Error: Expected a window log from %d to %d after '%s'.\n\n", IMAGE_WINDOWLOG_MIN, IMAGE_WINDOWLOG_MAX, argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--auto") == 0) {
+            if (i+1 < argc && sscanf(argv[i+1], "%u", &compress.autoBudgetMs) == 1 && compress.autoBudgetMs != 0)
+                i++;
+            else {
+                printf("Error: Expected a time budget in milliseconds after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--zstd-threads") == 0) {
+            // Without thread support the bound is 0; that is warned about below
+            int maxWorkers = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers).upperBound;
+
+            if (
+                i+1 < argc &&
+                sscanf(argv[i+1], "%d", &compress.workers) == 1 &&
+                compress.workers >= 0 && (maxWorkers == 0 || compress.workers <= maxWorkers)
+            )
+                i++;
+            else {
+                printf("Error: Expected a thread count from 0 to %d after '%s'.\n\n", maxWorkers, argv[i]);
+                usage(0);
+            }
+        }
+        else if (strcmp(argv[i], "--zstd-job-size") == 0) {
+            u64 jobSize;
+            if (i+1 < argc && (jobSize = parseByteSize(argv[i+1])) != 0 && jobSize <= UINT_MAX) {
+                compress.jobSize = (u32)jobSize;
+                i++;
+            }
+            else {
+                printf("Error: Expected a size such as '4M' after '%s'.\n\n", argv[i]);
+                usage(0);
+            }
+        }
         else if (strcmp(argv[i], "--output") == 0 || strcmp(argv[i], "-o") == 0) {
             if (i+1 < argc)
                 outputPath = argv[++i];
@@ -81,11 +444,29 @@ int main(int argc, char* argv[]) {
                 usage(0);
             }
         }
-        else
+        else if (strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) {
+            int jobs;
+            if (i+1 < argc && sscanf(argv[i+1], "%d", &jobs) == 1 && jobs >= 1 && jobs <= MAX_JOB_COUNT) {
+                jobCount = (unsigned)jobs;
+                i++;
+            }
+            else {
+                printf("Error: Expected a job count from 1 to %d after '%s'.\n\n", MAX_JOB_COUNT, argv[i]);
+                usage(0);
+            }
+        }
+        else {
             inputPath = argv[i];
+            inputPaths[inputPathCount++] = argv[i];
+        }
     }
 
-    if (outputPath == NULL) {
+    if (
+        outputPath == NULL &&
+        command != COMMAND_MANIFEST && command != COMMAND_SERVE &&
+        command != COMMAND_SCAN && command != COMMAND_OPTIMIZE &&
+        command != COMMAND_REPLACE_MASK && command != COMMAND_REPLACE_LEVEL
+    ) {
         printf("Error: Missing output path.\n\n");
         usage(0);
     }
@@ -95,101 +476,598 @@ int main(int argc, char* argv[]) {
         usage(0);
     }
 
+    if (command != COMMAND_OPTIMIZE) {
+        free(inputPaths);
+        inputPaths = NULL;
+    }
+
+    int batchMode =
+        command == COMMAND_MANIFEST || command == COMMAND_OPTIMIZE ||
+        (command == COMMAND_EXTRACT && isDirectory(inputPath));
+
+    if (shardCount > 1 && !batchMode)
+        warn("--shard only applies to batch modes and will be ignored.");
+    if (memBudget != 0 && !batchMode)
+        warn("--mem-budget only applies to batch modes and will be ignored.");
+    if (regenerate && !replaceLevelSet)
+        warn("--regenerate only applies to --replace-level and will be ignored.");
+    if (!ImageSelectIsAll(&select) && command != COMMAND_EXTRACT)
+        warn("--levels only applies to extraction and will be ignored.");
+    if (regionSet && (command != COMMAND_EXTRACT || batchMode || connectPath != NULL))
+        warn("--region only applies to single file extraction and will be ignored.");
+    else if (regionSet && !ImageSelectIsAll(&select))
+        warn("--region always extracts from level 0; --levels will be ignored.");
+
+    if (compress.workers > 0 && ZSTD_cParam_getBounds(ZSTD_c_nbWorkers).upperBound == 0) {
+        warn("This zstd library was built without thread support; --zstd-threads will be ignored.");
+        compress.workers = 0;
+    }
+
+    CpuInit(cpuName);
+
+    if (cacheDir != NULL)
+        CacheInit(cacheDir);
+
+    if (connectPath != NULL) {
+        if (command != COMMAND_EXTRACT && command != COMMAND_CREATE) {
+            printf("Error: --connect needs an extract or create request.\n\n");
+            usage(0);
+        }
+
+        return ClientRun(
+            connectPath,
+            command == COMMAND_EXTRACT ? SERVER_COMMAND_EXTRACT : SERVER_COMMAND_CREATE,
+            inputPath, maskPath, outputPath, &select
+        );
+    }
+
     switch (command) {
     case COMMAND_EXTRACT: {
         if (maskPath != NULL)
             warn("A mask has been provided in extract mode. The mask will not be used.");
 
-        printf("Read & copy image binary ..");
+        if (isDirectory(inputPath)) {
+            if (jobCount == 0)
+                jobCount = getCPUCount();
+
+            Batch batch;
+            BatchInit(&batch);
+            batch.cacheDir = cacheDir;
+            batch.memBudget = memBudget;
+            batch.select = select;
+
+            BatchCollectExtract(&batch, inputPath, outputPath);
+            if (batch.jobCount == 0)
+                panic("No .image files were found in the input directory.");
+
+            BatchWeighExtract(&batch);
+
+            if (shardCount > 1) {
+                u32 totalCount = batch.jobCount;
+
+                BatchSelectShard(&batch, shardIndex, shardCount);
 
-        FILE* fpImage = fopen(inputPath, "rb");
-        if (fpImage == NULL)
-            panic("The input image binary could not be opened.");
+                printf("Shard %u/%u: %u of %u file(s).\n", shardIndex, shardCount, batch.jobCount, totalCount);
+            }
+
+            printf("Extracting %u file(s) using %u thread(s) ..\n", batch.jobCount, jobCount);
+
+            if (memBudget != 0) {
+                printf("Memory budget: %lu MiB", memBudget >> 20);
+
+                u32 overCount = BatchCountOverBudget(&batch);
+                if (overCount != 0)
+                    printf(" (%u file(s) exceed it and will run alone)", overCount);
+
+                printf("\n");
+            }
+
+            u32 failedCount = BatchRun(&batch, BatchExtractJob, jobCount);
+
+            if (depfilePath)
+                BatchWriteDepfile(&batch, depfilePath, NULL);
 
-        fseek(fpImage, 0, SEEK_END);
-        u64 imageSize = ftell(fpImage);
-        rewind(fpImage);
+            printf("\nFinished! %u extracted, %u failed.\n", batch.jobCount - failedCount, failedCount);
 
-        if (imageSize == 0) {
-            fclose(fpImage);
+            BatchFree(&batch);
 
-            panic("The image binary is empty.");
+            return failedCount != 0;
         }
 
-        u8* imageBuf = (u8 *)malloc(imageSize);
-        if (imageBuf == NULL) {
-            fclose(fpImage);
+        printf("Map image binary ..");
 
-            panic("Failed to allocate memory (image binary buffer)");
+        MappedFile input;
+        MappedFileOpen(&input, inputPath);
+        ImageCheckSize(input.data, input.size);
+
+        LOG_OK;
+
+        u64 cacheKey = 0;
+        int cached = FALSE;
+
+        PathList written = { 0 };
+
+        if (cacheDir) {
+            char options[128];
+            CacheExtractOptions(options, sizeof(options), outputPath, &select);
+
+            if (regionSet) {
+                u32 length = strlen(options);
+                snprintf(
+                    options + length, sizeof(options) - length, " region=%u,%u,%u,%u",
+                    region[0], region[1], region[2], region[3]
+                );
+            }
+
+            cacheKey = CacheKeyCreate(options, input.data, input.size, NULL, 0);
+            cached = CacheFetchExtract(cacheDir, cacheKey, outputPath, &written);
         }
 
-        u64 bytesCopied = fread(imageBuf, 1, imageSize, fpImage);
-        if (bytesCopied != imageSize) {
-            free(imageBuf);
-            fclose(fpImage);
+        if (cached)
+            printf("Copied extracted images from cache.\n");
+        else {
+            if (regionSet) {
+                ImageExportRegion(input.data, region[0], region[1], region[2], region[3], outputPath);
+                PathListAdd(&written, outputPath);
+            }
+            else
+                ImageExportTexture(input.data, &select, outputPath, &written);
 
-            panic("The input image binary could not be read.");
+            if (cacheDir)
+                CacheStoreExtract(cacheDir, cacheKey, outputPath, &written);
         }
 
-        fclose(fpImage);
+        if (depfilePath) {
+            const char* inputs[1] = { inputPath };
 
-        LOG_OK;
+            FILE* fp = DepfileOpen(depfilePath);
+            DepfileWriteRule(fp, &written, inputs, 1);
+            DepfileClose(fp);
+        }
 
-        ImageExportTexture(imageBuf, outputPath);
+        PathListFree(&written);
+
+        MappedFileClose(&input);
     } break;
 
     case COMMAND_CREATE: {
         printf("Image file read-in ..");
 
+        u64 inputFileSize;
+        u8* inputFile = readFileBinary(inputPath, &inputFileSize);
+
+        u64 maskFileSize = 0;
+        u8* maskFile = NULL;
+        if (maskPath)
+            maskFile = readFileBinary(maskPath, &maskFileSize);
+
+        LOG_OK;
+
+        u64 cacheKey = 0;
+
+        if (cacheDir) {
+            char options[128];
+            CacheCreateOptions(options, sizeof(options), &compress);
+
+            cacheKey = CacheKeyCreate(options, inputFile, inputFileSize, maskFile, maskFileSize);
+
+            if (CacheFetchImage(cacheDir, cacheKey, outputPath)) {
+                printf("Copied IMAGE from cache.\n");
+
+                if (depfilePath)
+                    writeCreateDepfile(depfilePath, inputPath, maskPath, outputPath);
+
+                free(inputFile);
+                free(maskFile);
+                break;
+            }
+        }
+
         int imageWidth;
         int imageHeight;
 
-        u8* inputData = stbi_load(inputPath, &imageWidth, &imageHeight, NULL, 4);
+        u8* inputData = stbi_load_from_memory(inputFile, inputFileSize, &imageWidth, &imageHeight, NULL, 4);
         if (inputData == NULL)
-            panic("The input image file could not be opened.");
-
-        LOG_OK;
+            panic("The input image file could not be decoded.");
 
         int maskWidth = 0;
         int maskHeight = 0;
         u8* maskData = NULL;
 
-        if (maskPath) {
-            maskData = stbi_load(maskPath, &maskWidth, &maskHeight, NULL, 1);
+        if (maskFile) {
+            maskData = stbi_load_from_memory(maskFile, maskFileSize, &maskWidth, &maskHeight, NULL, 1);
             if (maskData == NULL)
-                panic("The input mask image could not be opened.");
+                panic("The input mask image could not be decoded.");
         }
 
-        u32 ktxSize;
-        u8* ktxData = KTXCreate(inputData, imageWidth, imageHeight, &ktxSize);
+        free(inputFile);
+        free(maskFile);
+
+        // Small images aren't worth starting threads for
+        if (jobCount == 0)
+            jobCount = (u64)imageWidth * imageHeight >= 1024 * 1024 ? getCPUCount() : 1;
+
+        // Levels are built on the pool, a band of a level per task
+        ThreadPool* pool = jobCount > 1 ? ThreadPoolCreate(jobCount) : NULL;
 
-        u32 imageSize;
-        u8* imageData = ImageCreate(
-            ktxData, ktxSize,
-            maskData, (u16)maskWidth, (u16)maskHeight,
-            &imageSize
+        printf("Write IMAGE to file ..\n");
+
+        ImageWriter* writer = ImageWriterCreate(
+            outputPath, NULL, &compress,
+            (u16)imageWidth, (u16)imageHeight,
+            KTXGetCreateSize(imageWidth, imageHeight)
         );
 
-        printf("Write IMAGE to file ..");
+        ImageWriterSetMask(writer, maskData, (u16)maskWidth, (u16)maskHeight);
 
-        FILE* file = fopen(outputPath, "wb");
-        if (file == NULL)
-            panic("The output image binary could not be opened for writing. Does the directory exist?");
+        if (compress.autoBudgetMs != 0) {
+            KTXView ktx;
+            KTXAllocate(inputData, imageWidth, imageHeight, &ktx);
 
-        fwrite(imageData, 1, imageSize, file);
+            // Levelzero is a copy, and the other levels are built from it
+            stbi_image_free(inputData);
+            inputData = NULL;
 
-        fclose(file);
+            logMsg("Generate mip levels (threads : %u) ..", pool ? jobCount : 1);
 
-        LOG_OK;
+            KTXCreateLevels(&ktx, pool);
+
+            LOG_OK;
+
+            printf("Picking compression settings (budget : %u ms) ..\n", compress.autoBudgetMs);
+
+            ImageWriterWriteKTXAuto(writer, ktx.data, ktx.size);
 
-        free(ktxData);
-        free(imageData);
+            char note[96];
+            ImageWriterDescribeAuto(writer, note, sizeof(note));
+
+            printf("Picked %s\n", note);
+
+            free(ktx.data);
+        }
+        else {
+            // Levels are compressed straight into the file one at a time, each
+            // as soon as it has been generated
+            ImageWriterGenerateKTX(writer, inputData, pool);
+        }
+
+        ImageWriterFinish(writer);
+
+        ImageWriterFree(writer);
+
+        if (pool)
+            ThreadPoolDestroy(pool);
+
+        if (cacheDir)
+            CacheStoreImage(cacheDir, cacheKey, outputPath);
+
+        if (depfilePath)
+            writeCreateDepfile(depfilePath, inputPath, maskPath, outputPath);
 
         stbi_image_free(inputData);
         if (maskData)
             stbi_image_free(maskData);
     } break;
     
+    case COMMAND_MANIFEST: {
+        if (jobCount == 0)
+            jobCount = getCPUCount();
+
+        Batch batch;
+        BatchInit(&batch);
+        batch.cacheDir = cacheDir;
+        batch.memBudget = memBudget;
+        batch.compress = compress;
+
+        BatchCollectManifest(&batch, inputPath);
+        if (batch.jobCount == 0)
+            panic("The manifest does not list any files.");
+
+        BatchWeighCreate(&batch);
+
+        if (shardCount > 1) {
+            u32 totalCount = batch.jobCount;
+
+            BatchSelectShard(&batch, shardIndex, shardCount);
+
+            printf("Shard %u/%u: %u of %u file(s).\n", shardIndex, shardCount, batch.jobCount, totalCount);
+        }
+
+        printf("Creating %u file(s) using %u thread(s) ..\n", batch.jobCount, jobCount);
+
+        if (memBudget != 0) {
+            printf("Memory budget: %lu MiB", memBudget >> 20);
+
+            u32 overCount = BatchCountOverBudget(&batch);
+            if (overCount != 0)
+                printf(" (%u file(s) exceed it and will run alone)", overCount);
+
+            printf("\n");
+        }
+
+        u32 failedCount = BatchRun(&batch, BatchCreateJob, jobCount);
+
+        if (depfilePath)
+            BatchWriteDepfile(&batch, depfilePath, inputPath);
+
+        printf("\nFinished! %u created, %u failed.\n", batch.jobCount - failedCount, failedCount);
+
+        BatchFree(&batch);
+
+        return failedCount != 0;
+    } break;
+    
+    case COMMAND_REPLACE_MASK: {
+        if (maskPath == NULL) {
+            printf("Error: --replace-mask needs a mask image (-m).\n\n");
+            usage(0);
+        }
+
+        // In place unless told otherwise
+        if (outputPath == NULL)
+            outputPath = inputPath;
+
+        printf("Map image binary ..");
+
+        MappedFile input;
+        MappedFileOpen(&input, inputPath);
+        ImageCheckSize(input.data, input.size);
+        ImageCheckHeader(input.data);
+
+        LOG_OK;
+
+        ImageFileHeader* fileHeader = (ImageFileHeader*)input.data;
+
+        printf("Mask file read-in ..");
+
+        u64 maskFileSize;
+        u8* maskFile = readFileBinary(maskPath, &maskFileSize);
+
+        int maskWidth, maskHeight;
+        u8* maskData = stbi_load_from_memory(maskFile, maskFileSize, &maskWidth, &maskHeight, NULL, 1);
+        if (maskData == NULL)
+            panic("The input mask image could not be decoded.");
+
+        free(maskFile);
+
+        LOG_OK;
+
+        // Never truncate the file that's still mapped
+        char tempPath[PATH_MAX];
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp.%d", outputPath, (int)getpid());
+
+        printf("Write IMAGE to file ..\n");
+
+        ImageWriter* writer = ImageWriterCreate(
+            tempPath, NULL, &compress,
+            fileHeader->width, fileHeader->height,
+            fileHeader->decompressedDataSize
+        );
+
+        ImageWriterSetMask(writer, maskData, (u16)maskWidth, (u16)maskHeight);
+
+        // The texture payload is copied as is
+        ImageWriterWriteCompressedKTX(writer, fileHeader->headerEnd, fileHeader->compressedDataSize);
+        ImageWriterFinish(writer);
+
+        ImageWriterFree(writer);
+
+        struct stat st;
+        if (stat(outputPath, &st) == 0)
+            chmod(tempPath, st.st_mode & 07777);
+
+        if (rename(tempPath, outputPath) != 0) {
+            unlink(tempPath);
+            panic("The output image binary could not be written.");
+        }
+
+        if (depfilePath)
+            writeCreateDepfile(depfilePath, inputPath, maskPath, outputPath);
+
+        stbi_image_free(maskData);
+        MappedFileClose(&input);
+    } break;
+
+    case COMMAND_REPLACE_LEVEL: {
+        // In place unless told otherwise
+        if (outputPath == NULL)
+            outputPath = inputPath;
+
+        printf("Map image binary ..");
+
+        MappedFile input;
+        MappedFileOpen(&input, inputPath);
+        ImageCheckSize(input.data, input.size);
+
+        LOG_OK;
+
+        ImageFileHeader* fileHeader = (ImageFileHeader*)input.data;
+
+        KTXView ktx;
+        ImageCreateKTXData(input.data, &ktx);
+
+        printf("Level image read-in ..");
+
+        u64 levelFileSize;
+        u8* levelFile = readFileBinary(levelImagePath, &levelFileSize);
+
+        int levelWidth, levelHeight;
+        u8* levelData = stbi_load_from_memory(levelFile, levelFileSize, &levelWidth, &levelHeight, NULL, 4);
+        if (levelData == NULL)
+            panic("The level image could not be decoded.");
+
+        free(levelFile);
+
+        LOG_OK;
+
+        printf("Replace level %u ..\n", replaceLevel);
+
+        KTXReplaceLevel(
+            &ktx, replaceLevel,
+            levelData, levelWidth, levelHeight,
+            regenerate
+        );
+
+        stbi_image_free(levelData);
+
+        // Never truncate the file that's still mapped
+        char tempPath[PATH_MAX];
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp.%d", outputPath, (int)getpid());
+
+        printf("Write IMAGE to file ..\n");
+
+        ImageWriter* writer = ImageWriterCreate(
+            tempPath, NULL, &compress,
+            fileHeader->width, fileHeader->height,
+            fileHeader->decompressedDataSize
+        );
+
+        // The mask is copied as is
+        if (ImageGetMaskExists(input.data)) {
+            ImageWriterSetCompressedMask(
+                writer,
+                fileHeader->headerEnd + fileHeader->compressedDataSize, fileHeader->maskCompressedDataSize,
+                fileHeader->maskWidth, fileHeader->maskHeight
+            );
+        }
+
+        if (compress.autoBudgetMs != 0) {
+            ImageWriterWriteKTXAuto(writer, ktx.data, ktx.size);
+
+            char note[96];
+            ImageWriterDescribeAuto(writer, note, sizeof(note));
+
+            printf("Picked %s\n", note);
+        }
+        else
+            ImageWriterWriteKTX(writer, ktx.data, ktx.size);
+
+        ImageWriterFinish(writer);
+
+        ImageWriterFree(writer);
+
+        struct stat st;
+        if (stat(outputPath, &st) == 0)
+            chmod(tempPath, st.st_mode & 07777);
+
+        if (rename(tempPath, outputPath) != 0) {
+            unlink(tempPath);
+            panic("The output image binary could not be written.");
+        }
+
+        if (depfilePath)
+            writeCreateDepfile(depfilePath, inputPath, levelImagePath, outputPath);
+
+        free(ktx.data);
+        MappedFileClose(&input);
+    } break;
+
+    case COMMAND_OPTIMIZE: {
+        if (jobCount == 0)
+            jobCount = getCPUCount();
+
+        // Shipping assets are built once and loaded many times
+        if (!levelSet && compress.autoBudgetMs == 0)
+            compress.level = OPTIMIZE_LVL;
+
+        Batch batch;
+        BatchInit(&batch);
+        batch.memBudget = memBudget;
+        batch.compress = compress;
+
+        BatchCollectOptimize(&batch, inputPaths, inputPathCount);
+        free(inputPaths);
+        if (batch.jobCount == 0)
+            panic("No .image files were found.");
+
+        BatchWeighOptimize(&batch);
+
+        if (shardCount > 1) {
+            u32 totalCount = batch.jobCount;
+
+            BatchSelectShard(&batch, shardIndex, shardCount);
+
+            printf("Shard %u/%u: %u of %u file(s).\n", shardIndex, shardCount, batch.jobCount, totalCount);
+        }
+
+        char description[64];
+        ImageCompressParamsDescribe(&compress, description, sizeof(description));
+
+        if (compress.autoBudgetMs != 0)
+            printf("Optimizing %u file(s) using %u thread(s) (auto, %u ms budget) ..\n", batch.jobCount, jobCount, compress.autoBudgetMs);
+        else
+            printf("Optimizing %u file(s) using %u thread(s) (%s) ..\n", batch.jobCount, jobCount, description);
+
+        if (memBudget != 0) {
+            printf("Memory budget: %lu MiB", memBudget >> 20);
+
+            u32 overCount = BatchCountOverBudget(&batch);
+            if (overCount != 0)
+                printf(" (%u file(s) exceed it and will run alone)", overCount);
+
+            printf("\n");
+        }
+
+        u32 failedCount = BatchRun(&batch, BatchOptimizeJob, jobCount);
+
+        printf(
+            "\nFinished! %u optimized, %u failed. Saved %lu bytes.\n",
+            batch.jobCount - failedCount, failedCount, batch.savedBytes
+        );
+
+        BatchFree(&batch);
+
+        return failedCount != 0;
+    } break;
+
+    case COMMAND_SCAN: {
+        if (jobCount == 0)
+            jobCount = getCPUCount();
+
+        if (!isDirectory(inputPath))
+            panic("The scan path is not a directory.");
+
+        Scan scan;
+        ScanRun(&scan, inputPath, scanKTX, jobCount);
+
+        // The catalog goes to stdout unless an output file is given
+        FILE* fp = stdout;
+        if (outputPath) {
+            fp = fopen(outputPath, "w");
+            if (fp == NULL)
+                panic("The output file could not be opened.");
+        }
+
+        if (scanFormat == SCAN_FORMAT_JSON)
+            ScanWriteJSON(&scan, fp);
+        else
+            ScanWriteCSV(&scan, fp);
+
+        u32 failedCount = 0;
+        for (u32 i = 0; i < scan.entryCount; i++) {
+            if (!scan.entries[i]->ok)
+                failedCount++;
+        }
+
+        if (outputPath) {
+            if (fclose(fp) != 0)
+                panic("The output file could not be written.");
+
+            printf("Scanned %u file(s), %u unreadable.\n", scan.entryCount, failedCount);
+        }
+
+        ScanFree(&scan);
+
+        return 0;
+    } break;
+
+    case COMMAND_SERVE: {
+        if (jobCount == 0)
+            jobCount = getCPUCount();
+
+        return ServerRun(inputPath, jobCount, &compress);
+    } break;
+
     default:
         panic("Invalid command");
         break;
@@ -0,0 +1,535 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "common.h"
+#include "cpu.h"
+#include "threadPool.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+// 2x2 box filter reduction of RGBA8 images, used to build every mip level
+// from the one before it. Each output pixel is the rounded average of the
+// 2x2 block above it. When a source dimension is odd, the last column (or
+// row) of blocks also takes in the leftover column (or row) so every source
+// pixel counts towards the result.
+
+// Averages count samples with rounding
+u8 MipRound(u32 sum, u32 count) {
+    return (u8)((sum + count / 2) / count);
+}
+
+// Output pixel j of a row, averaging columns 2j to 2j + columns - 1 of rows
+// rows of the source (each rowStride bytes apart).
+void MipReducePixel(u8* dst, const u8* src, u64 rowStride, u32 j, u32 columns, u32 rows) {
+    for (unsigned c = 0; c < 4; c++) {
+        u32 sum = 0;
+
+        for (unsigned y = 0; y < rows; y++) {
+            for (unsigned x = 0; x < columns; x++)
+                sum += src[y * rowStride + (2 * j + x) * 4 + c];
+        }
+
+        dst[j * 4 + c] = MipRound(sum, columns * rows);
+    }
+}
+
+// Writes count plain 2x2 averages of source rows r0 and r1, starting at
+// output pixel start. Returns how many pixels were done; vector kernels leave
+// the last few to the caller.
+typedef u32 (*MipRowKernel)(u8* dst, const u8* r0, const u8* r1, u32 start, u32 count);
+
+u32 MipRowScalar(u8* dst, const u8* r0, const u8* r1, u32 start, u32 count) {
+    for (u32 j = start; j < start + count; j++) {
+        for (unsigned c = 0; c < 4; c++) {
+            u32 sum =
+                r0[j * 8 + c] + r0[j * 8 + 4 + c] +
+                r1[j * 8 + c] + r1[j * 8 + 4 + c];
+
+            dst[j * 4 + c] = (u8)((sum + 2) >> 2);
+        }
+    }
+
+    return count;
+}
+
+#ifdef CPU_X86
+
+// Four output pixels per step. Each source pixel pair is widened to 16 bits
+// as it is loaded and the two rows are summed, then the two pixels of each
+// pair are added and the sums rounded and narrowed again.
+__attribute__((target("sse4.1")))
+u32 MipRowSSE41(u8* dst, const u8* r0, const u8* r1, u32 start, u32 count) {
+    const __m128i two = _mm_set1_epi16(2);
+
+    u32 j = start;
+
+    for (; j + 4 <= start + count; j += 4) {
+        __m128i s[4];
+
+        // One source pixel pair (one output pixel) per 8 bytes
+        for (unsigned k = 0; k < 4; k++) {
+            __m128i a = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(r0 + j * 8 + k * 8)));
+            __m128i b = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(r1 + j * 8 + k * 8)));
+
+            s[k] = _mm_add_epi16(a, b);
+        }
+
+        // Left pixel of each pair plus the right one
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s[0], s[1]), _mm_unpackhi_epi64(s[0], s[1]));
+        __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s[2], s[3]), _mm_unpackhi_epi64(s[2], s[3]));
+
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+
+        _mm_storeu_si128((__m128i*)(dst + j * 4), _mm_packus_epi16(lo, hi));
+    }
+
+    return j - start;
+}
+
+// Same as MipRowSSE41, eight output pixels per step. The 256-bit unpacks work
+// within 128-bit lanes, so the packed result is put back in order at the end.
+__attribute__((target("avx2")))
+u32 MipRowAVX2(u8* dst, const u8* r0, const u8* r1, u32 start, u32 count) {
+    const __m256i two = _mm256_set1_epi16(2);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    u32 j = start;
+
+    for (; j + 8 <= start + count; j += 8) {
+        __m256i s[4];
+
+        // Four source pixels (two output pixels) per 16 bytes
+        for (unsigned k = 0; k < 4; k++) {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r0 + j * 8 + k * 16)));
+            __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r1 + j * 8 + k * 16)));
+
+            s[k] = _mm256_add_epi16(a, b);
+        }
+
+        // Lanes hold outputs (0, 2 | 1, 3) and (4, 6 | 5, 7)
+        __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi64(s[0], s[1]), _mm256_unpackhi_epi64(s[0], s[1]));
+        __m256i hi = _mm256_add_epi16(_mm256_unpacklo_epi64(s[2], s[3]), _mm256_unpackhi_epi64(s[2], s[3]));
+
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+
+        __m256i packed = _mm256_packus_epi16(lo, hi);
+
+        _mm256_storeu_si256((__m256i*)(dst + j * 4), _mm256_permutevar8x32_epi32(packed, order));
+    }
+
+    return j - start;
+}
+
+// Same again, sixteen output pixels per step. Lane l of the packed result
+// holds outputs l, l + 4, l + 8 and l + 12.
+__attribute__((target("avx512f,avx512bw")))
+u32 MipRowAVX512(u8* dst, const u8* r0, const u8* r1, u32 start, u32 count) {
+    const __m512i two = _mm512_set1_epi16(2);
+    const __m512i order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+
+    u32 j = start;
+
+    for (; j + 16 <= start + count; j += 16) {
+        __m512i s[4];
+
+        // Eight source pixels (four output pixels) per 32 bytes
+        for (unsigned k = 0; k < 4; k++) {
+            __m512i a = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(r0 + j * 8 + k * 32)));
+            __m512i b = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(r1 + j * 8 + k * 32)));
+
+            s[k] = _mm512_add_epi16(a, b);
+        }
+
+        __m512i lo = _mm512_add_epi16(_mm512_unpacklo_epi64(s[0], s[1]), _mm512_unpackhi_epi64(s[0], s[1]));
+        __m512i hi = _mm512_add_epi16(_mm512_unpacklo_epi64(s[2], s[3]), _mm512_unpackhi_epi64(s[2], s[3]));
+
+        lo = _mm512_srli_epi16(_mm512_add_epi16(lo, two), 2);
+        hi = _mm512_srli_epi16(_mm512_add_epi16(hi, two), 2);
+
+        __m512i packed = _mm512_packus_epi16(lo, hi);
+
+        _mm512_storeu_si512((void*)(dst + j * 4), _mm512_permutexvar_epi32(order, packed));
+    }
+
+    return j - start;
+}
+
+#endif
+
+// Row kernel for each CPU level
+const MipRowKernel mipRowKernels[CPU_LEVEL_COUNT] = {
+    [CPU_SCALAR] = MipRowScalar,
+#ifdef CPU_X86
+    [CPU_SSE41]  = MipRowSSE41,
+    [CPU_AVX2]   = MipRowAVX2,
+    [CPU_AVX512] = MipRowAVX512
+#else
+    [CPU_SSE41]  = MipRowScalar,
+    [CPU_AVX2]   = MipRowScalar,
+    [CPU_AVX512] = MipRowScalar
+#endif
+};
+
+MipRowKernel MipGetRowKernel(void) {
+    return mipRowKernels[cpuLevel];
+}
+
+// Writes columns x0 to x1 - 1 of rows y0 to y1 - 1 of the half size image
+// MipReduce makes of the srcWidth x srcHeight RGBA8 image src. Regions of
+// one reduction can be done in any order and concurrently.
+void MipReduceRegion(u8* dst, const u8* src, u32 srcWidth, u32 srcHeight, u32 x0, u32 y0, u32 x1, u32 y1) {
+    u32 dstWidth = srcWidth / 2;
+    u32 dstHeight = srcHeight / 2;
+
+    MipRowKernel kernel = MipGetRowKernel();
+
+    u64 rowStride = (u64)srcWidth * 4;
+
+    // The last block column (row) is three wide (tall) for odd sources
+    int edgeX = (srcWidth & 1) && x1 == dstWidth;
+    int edgeY = (srcHeight & 1) && y1 == dstHeight;
+
+    u32 plainX1 = x1 - edgeX;
+
+    for (u32 i = y0; i < y1; i++) {
+        const u8* r0 = src + 2 * i * rowStride;
+        u8* dstRow = dst + (u64)i * dstWidth * 4;
+
+        if (edgeY && i == y1 - 1) {
+            for (u32 j = x0; j < x1; j++)
+                MipReducePixel(dstRow, r0, rowStride, j, (edgeX && j == x1 - 1) ? 3 : 2, 3);
+
+            continue;
+        }
+
+        u32 done = kernel(dstRow, r0, r0 + rowStride, x0, plainX1 - x0);
+        MipRowScalar(dstRow, r0, r0 + rowStride, x0 + done, plainX1 - x0 - done);
+
+        if (edgeX)
+            MipReducePixel(dstRow, r0, rowStride, x1 - 1, 3, 2);
+    }
+}
+
+// Reduces a srcWidth x srcHeight RGBA8 image to (srcWidth / 2) x
+// (srcHeight / 2), written to dst. dst may be src itself: every output pixel
+// is written after the source pixels it (and everything before it) reads.
+void MipReduce(u8* dst, const u8* src, u32 srcWidth, u32 srcHeight) {
+    if (srcWidth / 2 == 0 || srcHeight / 2 == 0)
+        return;
+
+    MipReduceRegion(dst, src, srcWidth, srcHeight, 0, 0, srcWidth / 2, srcHeight / 2);
+}
+
+// A whole mip chain is built tile by tile: a tile of levelzero is read once
+// and, while it is still in cache, reduced to its share of each of the next
+// MIP_TILE_LEVELS levels. Only those levels' results leave the cache, so
+// memory traffic is about one read of levelzero rather than one per level.
+// The levels past that are built the same way, MIP_TILE_LEVELS at a time,
+// from the last level of the tier before (see MipGetTierCount).
+// Tiles are wide and short (up to 4096 x 16 pixels, 256 KiB) so they fit in
+// L2 while each row is still read in one long run the prefetcher can follow.
+// Tiles are independent of each other.
+#define MIP_TILE_WIDTH  4096
+#define MIP_TILE_HEIGHT 16
+#define MIP_TILE_LEVELS 4 // log2(MIP_TILE_HEIGHT)
+
+// The last tile of a row (column) also takes the leftover pixels, so tiles
+// are up to twice as wide (tall).
+u32 MipGetTileCount(u32 size, u32 tileSize) {
+    return size < tileSize ? 1 : size / tileSize;
+}
+
+// Part of a level that tile index covers, from start to end - 1, for a
+// levelzero dimension of size
+void MipGetTileSpan(u32 size, u32 tileSize, u32 index, u32 mipIndex, u32* startOut, u32* endOut) {
+    *startOut = (index * tileSize) >> mipIndex;
+    *endOut = index == MipGetTileCount(size, tileSize) - 1 ?
+        size >> mipIndex :
+        ((index + 1) * tileSize) >> mipIndex;
+}
+
+// Builds the part of levels 1 to MIP_TILE_LEVELS (as far as levelCount goes)
+// under tile (tileX, tileY) of levelzero. levels holds each level's RGBA8
+// data, levelzero first.
+void MipGenerateTile(u8* const* levels, u32 levelCount, u32 width, u32 height, u32 tileX, u32 tileY) {
+    for (u32 i = 1; i < levelCount && i <= MIP_TILE_LEVELS; i++) {
+        u32 x0, x1, y0, y1;
+        MipGetTileSpan(width, MIP_TILE_WIDTH, tileX, i, &x0, &x1);
+        MipGetTileSpan(height, MIP_TILE_HEIGHT, tileY, i, &y0, &y1);
+
+        if (x0 == x1 || y0 == y1)
+            break;
+
+        MipReduceRegion(levels[i], levels[i - 1], width >> (i - 1), height >> (i - 1), x0, y0, x1, y1);
+    }
+}
+
+// For threads, tiles are handed out a group of MIP_TASK_TILE_ROWS tile rows
+// (64 rows of levelzero) at a time. Tasks of one tier are independent of
+// each other.
+#define MIP_TASK_TILE_ROWS 4
+
+u32 MipGetTaskCount(u32 height) {
+    return (MipGetTileCount(height, MIP_TILE_HEIGHT) + MIP_TASK_TILE_ROWS - 1) / MIP_TASK_TILE_ROWS;
+}
+
+// Builds every tile of task index
+void MipGenerateTask(u8* const* levels, u32 levelCount, u32 width, u32 height, u32 index) {
+    u32 tileRowCount = MipGetTileCount(height, MIP_TILE_HEIGHT);
+
+    u32 tileYEnd = (index + 1) * MIP_TASK_TILE_ROWS;
+    if (tileYEnd > tileRowCount)
+        tileYEnd = tileRowCount;
+
+    for (u32 tileY = index * MIP_TASK_TILE_ROWS; tileY < tileYEnd; tileY++) {
+        for (u32 tileX = 0; tileX < MipGetTileCount(width, MIP_TILE_WIDTH); tileX++)
+            MipGenerateTile(levels, levelCount, width, height, tileX, tileY);
+    }
+}
+
+// Tier t builds levels t * MIP_TILE_LEVELS + 1 to (t + 1) * MIP_TILE_LEVELS
+// from level t * MIP_TILE_LEVELS, the way tier 0 builds from levelzero.
+#define MIP_MAX_LEVELS 32
+#define MIP_MAX_TIERS ((MIP_MAX_LEVELS - 2) / MIP_TILE_LEVELS + 1)
+
+u32 MipGetTierCount(u32 levelCount) {
+    return levelCount > 1 ? (levelCount - 2) / MIP_TILE_LEVELS + 1 : 0;
+}
+
+// Tier tier's source dimension for levelzero dimension size
+u32 MipGetTierSize(u32 size, u32 tier) {
+    return size >> (tier * MIP_TILE_LEVELS);
+}
+
+// Builds every tile of task index of tier
+void MipGenerateTierTask(u8* const* levels, u32 levelCount, u32 width, u32 height, u32 tier, u32 index) {
+    u32 base = tier * MIP_TILE_LEVELS;
+
+    MipGenerateTask(
+        levels + base, levelCount - base,
+        MipGetTierSize(width, tier), MipGetTierSize(height, tier), index
+    );
+}
+
+// Builds levels 1 to levelCount - 1 from levelzero.
+void MipGenerate(u8* const* levels, u32 levelCount, u32 width, u32 height) {
+    for (u32 tier = 0; tier < MipGetTierCount(levelCount); tier++) {
+        for (u32 i = 0; i < MipGetTaskCount(MipGetTierSize(height, tier)); i++)
+            MipGenerateTierTask(levels, levelCount, width, height, tier, i);
+    }
+}
+
+// MipGenerate on a thread pool. A task of tier t + 1 only reads the rows of
+// its source level that a few tasks of tier t build, so it counts those down
+// and is submitted by whichever of them finishes last; there is no barrier
+// between tiers. A tier's levels are done once all of its tasks are, which
+// MipChainWaitLevel waits for. Nothing here waits for the pool to go idle,
+// so the pool can be shared with other work.
+
+struct MipChain;
+
+typedef struct {
+    struct MipChain* chain;
+    u32 tier, index;
+
+    u32 pendingSources; // Atomic; tasks of the tier before still building rows this one reads
+
+    // Tasks of the next tier that read rows this one builds
+    u32 firstDependent, lastDependent;
+} MipChainTask;
+
+typedef void (*MipChainDoneFunc)(void* userData, unsigned workerIndex);
+
+typedef struct MipChain {
+    u8* levels[MIP_MAX_LEVELS];
+    u32 levelCount;
+    u32 width, height;
+
+    ThreadPool* pool;
+    MipChainDoneFunc done;
+    void* userData;
+
+    u32 tierCount;
+    u32 taskCounts[MIP_MAX_TIERS];
+    MipChainTask* tiers[MIP_MAX_TIERS]; // Into tasks
+    u32 pendingTasks[MIP_MAX_TIERS]; // Atomic
+
+    MipChainTask* tasks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t levelCond;
+    u32 levelsDone; // Levels 1 to levelsDone are built
+} MipChain;
+
+// Must be freed after creation (MipChainDestroy). levels holds each level's
+// RGBA8 buffer, levelzero (the source) first.
+MipChain* MipChainCreate(u8* const* levels, u32 levelCount, u32 width, u32 height) {
+    MipChain* chain = (MipChain*)calloc(1, sizeof(MipChain));
+    if (chain == NULL)
+        panic("Failed to allocate memory (mip chain)");
+
+    for (u32 i = 0; i < levelCount; i++)
+        chain->levels[i] = levels[i];
+
+    chain->levelCount = levelCount;
+    chain->width = width;
+    chain->height = height;
+
+    chain->tierCount = MipGetTierCount(levelCount);
+
+    u32 taskCount = 0;
+    for (u32 tier = 0; tier < chain->tierCount; tier++) {
+        chain->taskCounts[tier] = MipGetTaskCount(MipGetTierSize(height, tier));
+        taskCount += chain->taskCounts[tier];
+    }
+
+    chain->tasks = (MipChainTask*)calloc(taskCount ? taskCount : 1, sizeof(MipChainTask));
+    if (chain->tasks == NULL) {
+        free(chain);
+        panic("Failed to allocate memory (mip chain)");
+    }
+
+    MipChainTask* task = chain->tasks;
+    for (u32 tier = 0; tier < chain->tierCount; tier++) {
+        chain->tiers[tier] = task;
+        chain->pendingTasks[tier] = chain->taskCounts[tier];
+
+        for (u32 i = 0; i < chain->taskCounts[tier]; i++, task++) {
+            task->chain = chain;
+            task->tier = tier;
+            task->index = i;
+        }
+    }
+
+    // Task i of a tier builds rows i * MIP_TASK_TILE_ROWS onwards of the next
+    // tier's source level (the last task builds up to its end), and task j of
+    // the next tier reads rows j * MIP_TASK_TILE_ROWS * MIP_TILE_HEIGHT
+    // onwards (the last task reads up to the end).
+    u32 sourceRows = MIP_TASK_TILE_ROWS * MIP_TILE_HEIGHT;
+
+    for (u32 tier = 0; tier + 1 < chain->tierCount; tier++) {
+        u32 rowCount = MipGetTierSize(height, tier + 1);
+        u32 dependentCount = chain->taskCounts[tier + 1];
+
+        for (u32 i = 0; i < chain->taskCounts[tier]; i++) {
+            MipChainTask* source = &chain->tiers[tier][i];
+
+            u32 rowStart = i * MIP_TASK_TILE_ROWS;
+            u32 rowEnd = i == chain->taskCounts[tier] - 1 ? rowCount : rowStart + MIP_TASK_TILE_ROWS;
+
+            // No rows of the next tier under this task; it still goes to a
+            // task so the tier can't start early
+            if (rowEnd <= rowStart)
+                rowEnd = rowStart + 1;
+
+            source->firstDependent = rowStart / sourceRows;
+            source->lastDependent = (rowEnd - 1) / sourceRows;
+
+            if (source->firstDependent > dependentCount - 1)
+                source->firstDependent = dependentCount - 1;
+            if (source->lastDependent > dependentCount - 1)
+                source->lastDependent = dependentCount - 1;
+
+            for (u32 j = source->firstDependent; j <= source->lastDependent; j++)
+                chain->tiers[tier + 1][j].pendingSources++;
+        }
+    }
+
+    pthread_mutex_init(&chain->lock, NULL);
+    pthread_cond_init(&chain->levelCond, NULL);
+
+    return chain;
+}
+
+void MipChainDestroy(MipChain* chain) {
+    pthread_mutex_destroy(&chain->lock);
+    pthread_cond_destroy(&chain->levelCond);
+
+    free(chain->tasks);
+    free(chain);
+}
+
+void MipChainTaskRun(void* arg, unsigned workerIndex) {
+    MipChainTask* task = (MipChainTask*)arg;
+    MipChain* chain = task->chain;
+
+    u32 tier = task->tier;
+    u32 firstDependent = task->firstDependent;
+    u32 lastDependent = task->lastDependent;
+
+    ThreadPool* pool = chain->pool;
+    MipChainDoneFunc done = chain->done;
+    void* userData = chain->userData;
+    int lastTier = tier == chain->tierCount - 1;
+
+    MipGenerateTierTask(chain->levels, chain->levelCount, chain->width, chain->height, tier, task->index);
+
+    if (__atomic_sub_fetch(&chain->pendingTasks[tier], 1, __ATOMIC_ACQ_REL) == 0) {
+        u32 levelsDone = (tier + 1) * MIP_TILE_LEVELS;
+        if (levelsDone > chain->levelCount - 1)
+            levelsDone = chain->levelCount - 1;
+
+        pthread_mutex_lock(&chain->lock);
+        chain->levelsDone = levelsDone;
+        pthread_cond_broadcast(&chain->levelCond);
+        pthread_mutex_unlock(&chain->lock);
+
+        // A waiter may destroy the chain from here on
+        if (lastTier) {
+            if (done)
+                done(userData, workerIndex);
+            return;
+        }
+    }
+
+    if (lastTier)
+        return;
+
+    // Only the last of these can let the chain finish, so the chain is
+    // still there for every one before it
+    MipChainTask* dependents = chain->tiers[tier + 1];
+
+    for (u32 j = firstDependent; j <= lastDependent; j++) {
+        if (__atomic_sub_fetch(&dependents[j].pendingSources, 1, __ATOMIC_ACQ_REL) == 0)
+            ThreadPoolSubmit(pool, MipChainTaskRun, &dependents[j]);
+    }
+}
+
+// Submits the first tier to pool. done (if not NULL) is called with userData
+// on the worker that finishes the last level, after which the chain may be
+// destroyed; with nothing to build it's called right away with workerIndex.
+void MipChainStart(MipChain* chain, ThreadPool* pool, MipChainDoneFunc done, void* userData, unsigned workerIndex) {
+    chain->pool = pool;
+    chain->done = done;
+    chain->userData = userData;
+
+    if (chain->tierCount == 0) {
+        if (done)
+            done(userData, workerIndex);
+        return;
+    }
+
+    for (u32 i = 0; i < chain->taskCounts[0]; i++)
+        ThreadPoolSubmit(pool, MipChainTaskRun, &chain->tiers[0][i]);
+}
+
+// Blocks until level levelIndex (and every one before it) is built.
+void MipChainWaitLevel(MipChain* chain, u32 levelIndex) {
+    pthread_mutex_lock(&chain->lock);
+
+    while (chain->levelsDone < levelIndex)
+        pthread_cond_wait(&chain->levelCond, &chain->lock);
+
+    pthread_mutex_unlock(&chain->lock);
+}
+
+void MipChainWait(MipChain* chain) {
+    if (chain->levelCount > 1)
+        MipChainWaitLevel(chain, chain->levelCount - 1);
+}
+
+#endif
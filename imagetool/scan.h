@@ -0,0 +1,425 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <strings.h>
+
+#include "common.h"
+#include "imageProcess.h"
+#include "threadPool.h"
+
+// Header-only catalog of an asset tree. Only the ImageFileHeader of each file
+// is read (plus, if asked, the start of the compressed KTX data, which is
+// decompressed just far enough to get the KTXHeader). Directories are walked
+// in parallel: every directory and every file is its own pool task.
+
+// First read per file; enough for the file header and usually the KTX header
+#define SCAN_READ_SIZE 512
+// Further reads when the first zstd block is larger
+#define SCAN_READ_MORE_SIZE 4096
+
+#define SCAN_FORMAT_CSV  0
+#define SCAN_FORMAT_JSON 1
+
+typedef struct {
+    char* path;
+
+    int ok;
+    char error[128];
+
+    ImageFileHeader header;
+
+    int hasKTX;
+    KTXHeader ktxHeader;
+} ScanEntry;
+
+typedef struct {
+    ThreadPool* pool;
+    int readKTX;
+
+    ZSTD_DCtx** dctxs; // One per worker
+
+    pthread_mutex_t lock;
+    ScanEntry** entries;
+    u32 entryCount;
+    u32 entryCapacity;
+} Scan;
+
+typedef struct {
+    Scan* scan;
+    char* path;
+} ScanTask;
+
+// Must be freed after creation
+ScanTask* ScanTaskCreate(Scan* scan, const char* path) {
+    ScanTask* task = (ScanTask*)malloc(sizeof(ScanTask));
+    if (task == NULL)
+        panic("Failed to allocate memory (scan task)");
+
+    task->scan = scan;
+    task->path = strdup(path);
+    if (task->path == NULL)
+        panic("Failed to allocate memory (scan task)");
+
+    return task;
+}
+
+void ScanAddEntry(Scan* scan, ScanEntry* entry) {
+    pthread_mutex_lock(&scan->lock);
+
+    if (scan->entryCount == scan->entryCapacity) {
+        scan->entryCapacity = scan->entryCapacity ? scan->entryCapacity * 2 : 256;
+        scan->entries = (ScanEntry**)realloc(scan->entries, scan->entryCapacity * sizeof(ScanEntry*));
+        if (scan->entries == NULL)
+            panic("Failed to allocate memory (scan entries)");
+    }
+
+    scan->entries[scan->entryCount++] = entry;
+
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Decompresses the first bytes of the KTX data into entry->ktxHeader.
+// buf holds bufSize bytes read from the start of the file; more are read
+// from fd if the first zstd block doesn't fit. Returns FALSE with
+// entry->error set on failure.
+int ScanReadKTXHeader(ZSTD_DCtx* dctx, int fd, u8* buf, u64 bufSize, ScanEntry* entry) {
+    u64 payloadEnd = sizeof(ImageFileHeader) + (u64)entry->header.compressedDataSize;
+
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+    ZSTD_outBuffer output = { .dst = &entry->ktxHeader, .size = sizeof(KTXHeader), .pos = 0 };
+
+    u8 more[SCAN_READ_MORE_SIZE];
+
+    u64 offset = sizeof(ImageFileHeader);
+    u8* chunk = buf + offset;
+    u64 chunkSize = bufSize > payloadEnd ? payloadEnd - offset : bufSize - offset;
+
+    while (output.pos < output.size) {
+        ZSTD_inBuffer input = { .src = chunk, .size = chunkSize, .pos = 0 };
+
+        while (input.pos < input.size && output.pos < output.size) {
+            size_t result = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(result)) {
+                snprintf(entry->error, sizeof(entry->error), "KTX decompression error");
+                return FALSE;
+            }
+
+            if (result == 0)
+                break;
+        }
+
+        offset += chunkSize;
+        if (output.pos == output.size)
+            break;
+
+        if (offset >= payloadEnd) {
+            snprintf(entry->error, sizeof(entry->error), "KTX data is too small to hold a header");
+            return FALSE;
+        }
+
+        u64 wanted = payloadEnd - offset < sizeof(more) ? payloadEnd - offset : sizeof(more);
+
+        ssize_t bytesRead = pread(fd, more, wanted, offset);
+        if (bytesRead <= 0) {
+            snprintf(entry->error, sizeof(entry->error), "The image binary is truncated.");
+            return FALSE;
+        }
+
+        chunk = more;
+        chunkSize = bytesRead;
+    }
+
+    if (memcmp(entry->ktxHeader.identifier, KTX_IDENTIFIER, 12) != 0) {
+        snprintf(entry->error, sizeof(entry->error), "KTX header identifier is nonmatching");
+        return FALSE;
+    }
+
+    if (entry->ktxHeader.endianness == KTX_BIG_ENDIAN) {
+        KTXSwapHeader(&entry->ktxHeader);
+        entry->ktxHeader.endianness = KTX_LITTLE_ENDIAN;
+    }
+    else if (entry->ktxHeader.endianness != KTX_LITTLE_ENDIAN) {
+        snprintf(entry->error, sizeof(entry->error), "KTX header has bad endianness value");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void ScanFileTask(void* arg, unsigned workerIndex) {
+    ScanTask* task = (ScanTask*)arg;
+    Scan* scan = task->scan;
+
+    ScanEntry* entry = (ScanEntry*)calloc(1, sizeof(ScanEntry));
+    if (entry == NULL)
+        panic("Failed to allocate memory (scan entry)");
+
+    entry->path = task->path;
+    free(task);
+
+    int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(entry->error, sizeof(entry->error), "The input image binary could not be opened.");
+        ScanAddEntry(scan, entry);
+        return;
+    }
+
+    u8 buf[SCAN_READ_SIZE];
+    ssize_t bytesRead = pread(fd, buf, scan->readKTX ? sizeof(buf) : sizeof(ImageFileHeader), 0);
+
+    if (bytesRead < (ssize_t)sizeof(ImageFileHeader))
+        snprintf(entry->error, sizeof(entry->error), "The image binary is too small to hold a header.");
+    else {
+        memcpy(&entry->header, buf, sizeof(ImageFileHeader));
+
+        if (entry->header.magic != IMAGE_MAGIC)
+            snprintf(entry->error, sizeof(entry->error), "Image header magic is nonmatching");
+        else if (scan->readKTX)
+            entry->hasKTX = ScanReadKTXHeader(scan->dctxs[workerIndex], fd, buf, bytesRead, entry);
+
+        entry->ok = entry->header.magic == IMAGE_MAGIC && (!scan->readKTX || entry->hasKTX);
+    }
+
+    close(fd);
+
+    ScanAddEntry(scan, entry);
+}
+
+void ScanDirectoryTask(void* arg, unsigned workerIndex) {
+    ScanTask* task = (ScanTask*)arg;
+    Scan* scan = task->scan;
+
+    (void)workerIndex;
+
+    DIR* dir = opendir(task->path);
+    if (dir == NULL) {
+        warn("A directory could not be opened, skipping.");
+
+        free(task->path);
+        free(task);
+        return;
+    }
+
+    struct dirent* dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL) {
+        const char* name = dirEntry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", task->path, name) >= PATH_MAX)
+            continue;
+
+        // d_type saves a stat per entry; symlinks are not followed
+        int isDir = dirEntry->d_type == DT_DIR;
+        int isReg = dirEntry->d_type == DT_REG;
+
+        if (dirEntry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) != 0)
+                continue;
+
+            isDir = S_ISDIR(st.st_mode);
+            isReg = S_ISREG(st.st_mode);
+        }
+
+        if (isDir)
+            ThreadPoolSubmit(scan->pool, ScanDirectoryTask, ScanTaskCreate(scan, path));
+        else if (isReg) {
+            const char* dot = strrchr(name, '.');
+            if (dot != NULL && strcasecmp(dot, ".image") == 0)
+                ThreadPoolSubmit(scan->pool, ScanFileTask, ScanTaskCreate(scan, path));
+        }
+    }
+
+    closedir(dir);
+
+    free(task->path);
+    free(task);
+}
+
+int ScanEntryCompare(const void* a, const void* b) {
+    return strcmp((*(ScanEntry**)a)->path, (*(ScanEntry**)b)->path);
+}
+
+// Scans every .image file below root using threadCount workers. Entries are
+// sorted by path.
+void ScanRun(Scan* scan, const char* root, int readKTX, unsigned threadCount) {
+    if (threadCount == 0)
+        threadCount = 1;
+
+    memset(scan, 0, sizeof(Scan));
+    pthread_mutex_init(&scan->lock, NULL);
+
+    scan->readKTX = readKTX;
+
+    if (readKTX) {
+        scan->dctxs = (ZSTD_DCtx**)calloc(threadCount, sizeof(ZSTD_DCtx*));
+        if (scan->dctxs == NULL)
+            panic("Failed to allocate memory (scan contexts)");
+
+        for (unsigned i = 0; i < threadCount; i++) {
+            scan->dctxs[i] = ZSTD_createDCtx();
+            if (scan->dctxs[i] == NULL)
+                panic("Failed to create ZSTD decompression context");
+        }
+    }
+
+    char rootPath[PATH_MAX];
+    snprintf(rootPath, sizeof(rootPath), "%s", root);
+
+    u32 rootLength = strlen(rootPath);
+    while (rootLength > 1 && rootPath[rootLength - 1] == '/')
+        rootPath[--rootLength] = '\0';
+
+    scan->pool = ThreadPoolCreate(threadCount);
+
+    ThreadPoolSubmit(scan->pool, ScanDirectoryTask, ScanTaskCreate(scan, rootPath));
+
+    ThreadPoolWait(scan->pool);
+    ThreadPoolDestroy(scan->pool);
+    scan->pool = NULL;
+
+    if (scan->dctxs) {
+        for (unsigned i = 0; i < threadCount; i++)
+            ZSTD_freeDCtx(scan->dctxs[i]);
+
+        free(scan->dctxs);
+        scan->dctxs = NULL;
+    }
+
+    // Stable order regardless of readdir and thread order
+    qsort(scan->entries, scan->entryCount, sizeof(ScanEntry*), ScanEntryCompare);
+}
+
+void ScanFree(Scan* scan) {
+    for (u32 i = 0; i < scan->entryCount; i++) {
+        free(scan->entries[i]->path);
+        free(scan->entries[i]);
+    }
+    free(scan->entries);
+
+    pthread_mutex_destroy(&scan->lock);
+}
+
+const char* ScanFormatName(u32 glInternalFormat) {
+    const KTXFormat* format = KTXFindFormat(glInternalFormat);
+    return format ? format->name : "unknown";
+}
+
+// Quotes a CSV field if needed
+void ScanWriteCSVString(FILE* fp, const char* str) {
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        fputs(str, fp);
+        return;
+    }
+
+    fputc('"', fp);
+    for (const char* c = str; *c; c++) {
+        if (*c == '"')
+            fputc('"', fp);
+        fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+void ScanWriteJSONString(FILE* fp, const char* str) {
+    fputc('"', fp);
+
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(fp, "\\u%04x", *c);
+        else
+            fputc(*c, fp);
+    }
+
+    fputc('"', fp);
+}
+
+void ScanWriteCSV(Scan* scan, FILE* fp) {
+    fprintf(
+        fp,
+        "path,width,height,compressed_size,decompressed_size,"
+        "mask_width,mask_height,mask_compressed_size,mask_decompressed_size%s,error\n",
+        scan->readKTX ? ",mip_count,format" : ""
+    );
+
+    for (u32 i = 0; i < scan->entryCount; i++) {
+        ScanEntry* entry = scan->entries[i];
+        ImageFileHeader* header = &entry->header;
+
+        ScanWriteCSVString(fp, entry->path);
+
+        if (entry->ok) {
+            fprintf(
+                fp, ",%u,%u,%u,%u,%u,%u,%u,%u",
+                header->width, header->height,
+                header->compressedDataSize, header->decompressedDataSize,
+                header->maskWidth, header->maskHeight,
+                header->maskCompressedDataSize, header->maskDecompressedDataSize
+            );
+
+            if (scan->readKTX)
+                fprintf(
+                    fp, ",%u,%s",
+                    entry->ktxHeader.numberOfMipmapLevels,
+                    ScanFormatName(entry->ktxHeader.glInternalFormat)
+                );
+
+            fputs(",\n", fp);
+        }
+        else {
+            fputs(scan->readKTX ? ",,,,,,,,,,," : ",,,,,,,,,", fp);
+            ScanWriteCSVString(fp, entry->error);
+            fputc('\n', fp);
+        }
+    }
+}
+
+void ScanWriteJSON(Scan* scan, FILE* fp) {
+    fputs("[\n", fp);
+
+    for (u32 i = 0; i < scan->entryCount; i++) {
+        ScanEntry* entry = scan->entries[i];
+        ImageFileHeader* header = &entry->header;
+
+        fputs("  {\"path\": ", fp);
+        ScanWriteJSONString(fp, entry->path);
+
+        if (entry->ok) {
+            fprintf(
+                fp,
+                ", \"width\": %u, \"height\": %u"
+                ", \"compressed_size\": %u, \"decompressed_size\": %u"
+                ", \"mask_width\": %u, \"mask_height\": %u"
+                ", \"mask_compressed_size\": %u, \"mask_decompressed_size\": %u",
+                header->width, header->height,
+                header->compressedDataSize, header->decompressedDataSize,
+                header->maskWidth, header->maskHeight,
+                header->maskCompressedDataSize, header->maskDecompressedDataSize
+            );
+
+            if (scan->readKTX)
+                fprintf(
+                    fp, ", \"mip_count\": %u, \"format\": \"%s\"",
+                    entry->ktxHeader.numberOfMipmapLevels,
+                    ScanFormatName(entry->ktxHeader.glInternalFormat)
+                );
+        }
+        else {
+            fputs(", \"error\": ", fp);
+            ScanWriteJSONString(fp, entry->error);
+        }
+
+        fputs(i + 1 < scan->entryCount ? "},\n" : "}\n", fp);
+    }
+
+    fputs("]\n", fp);
+}
+
+#endif
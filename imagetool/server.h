@@ -0,0 +1,716 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <signal.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "imageProcess.h"
+#include "threadPool.h"
+#include "batch.h"
+
+#define SERVER_MAGIC 0x76726573 // "serv"
+
+#define SERVER_COMMAND_EXTRACT 1
+#define SERVER_COMMAND_CREATE  2
+
+// ServerRequest.fdFlags: inputs passed as descriptors (SCM_RIGHTS), in this order
+#define SERVER_FD_INPUT 0x1
+#define SERVER_FD_MASK  0x2
+
+// Decoded KTX data kept around for repeated extracts of the same file
+#define SERVER_CACHE_BYTES (256ul * 1024 * 1024)
+
+typedef struct {
+    u32 magic; // Compare to SERVER_MAGIC
+    u32 command;
+    u32 fdFlags;
+
+    // Used for inputs not passed as descriptors. Paths must be absolute.
+    char inputPath[PATH_MAX];
+    char maskPath[PATH_MAX]; // Empty for no mask
+    char outputPath[PATH_MAX];
+
+    ImageSelect select; // Extract
+} ServerRequest;
+
+typedef struct {
+    u32 ok;
+    char message[256];
+} ServerResponse;
+
+typedef struct ServerCacheEntry {
+    // LRU list, most recently used first
+    struct ServerCacheEntry* prev;
+    struct ServerCacheEntry* next;
+
+    // Identity of the source .image file
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+
+    KTXView ktx;
+
+    u32 refCount;
+} ServerCacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    ServerCacheEntry* head;
+    ServerCacheEntry* tail;
+
+    u64 totalSize;
+    u64 capacity;
+
+    u64 hits;
+    u64 misses;
+} ServerCache;
+
+typedef struct {
+    ServerCache cache;
+
+    BatchWorker* workers;
+    unsigned workerCount;
+
+    ImageCompressParams compress;
+} Server;
+
+typedef struct {
+    Server* server;
+    int conn;
+
+    // Kept here rather than on the stack so they survive a panic unwind
+    MappedFile input;
+    MappedFile mask;
+    KTXView ktx; // Extract: until it is handed to the cache. Create: --auto's KTX data
+} ServerConnection;
+
+volatile sig_atomic_t serverStopping = FALSE;
+
+void ServerCacheUnlink(ServerCache* cache, ServerCacheEntry* entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+void ServerCachePushFront(ServerCache* cache, ServerCacheEntry* entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+
+    cache->head = entry;
+}
+
+// Drops least recently used entries nobody holds until the cache fits.
+// Lock must be held.
+void ServerCacheEvict(ServerCache* cache) {
+    ServerCacheEntry* entry = cache->tail;
+
+    while (entry != NULL && cache->totalSize > cache->capacity) {
+        ServerCacheEntry* prev = entry->prev;
+
+        if (entry->refCount == 0) {
+            ServerCacheUnlink(cache, entry);
+            cache->totalSize -= entry->ktx.size;
+
+            free(entry->ktx.data);
+            free(entry);
+        }
+
+        entry = prev;
+    }
+}
+
+int ServerCacheMatches(ServerCacheEntry* entry, struct stat* st) {
+    return
+        entry->device == st->st_dev &&
+        entry->inode == st->st_ino &&
+        entry->size == st->st_size &&
+        entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Returns a held entry, or NULL on a miss
+ServerCacheEntry* ServerCacheAcquire(ServerCache* cache, struct stat* st) {
+    pthread_mutex_lock(&cache->lock);
+
+    ServerCacheEntry* entry = cache->head;
+    while (entry != NULL && !ServerCacheMatches(entry, st))
+        entry = entry->next;
+
+    if (entry != NULL) {
+        entry->refCount++;
+
+        ServerCacheUnlink(cache, entry);
+        ServerCachePushFront(cache, entry);
+
+        cache->hits++;
+    }
+    else
+        cache->misses++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+// Takes ownership of ktx->data (and clears it) unless it panics. Returns a
+// held entry, which is an existing one if another worker inserted the same
+// file first.
+ServerCacheEntry* ServerCacheInsert(ServerCache* cache, struct stat* st, KTXView* ktx) {
+    pthread_mutex_lock(&cache->lock);
+
+    ServerCacheEntry* entry = cache->head;
+    while (entry != NULL && !ServerCacheMatches(entry, st))
+        entry = entry->next;
+
+    if (entry != NULL)
+        free(ktx->data);
+    else {
+        entry = (ServerCacheEntry*)calloc(1, sizeof(ServerCacheEntry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+
+            panic("Failed to allocate memory (server cache entry)");
+        }
+
+        entry->device = st->st_dev;
+        entry->inode = st->st_ino;
+        entry->size = st->st_size;
+        entry->mtime = st->st_mtim;
+
+        entry->ktx = *ktx;
+
+        ServerCachePushFront(cache, entry);
+        cache->totalSize += ktx->size;
+    }
+
+    ktx->data = NULL;
+
+    entry->refCount++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+void ServerCacheRelease(ServerCache* cache, ServerCacheEntry* entry) {
+    pthread_mutex_lock(&cache->lock);
+
+    entry->refCount--;
+    ServerCacheEvict(cache);
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void ServerCacheFree(ServerCache* cache) {
+    ServerCacheEntry* entry = cache->head;
+    while (entry != NULL) {
+        ServerCacheEntry* next = entry->next;
+
+        free(entry->ktx.data);
+        free(entry);
+
+        entry = next;
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+}
+
+void ServerExtract(Server* server, ServerRequest* request, int inputFd, MappedFile* input, KTXView* ktx, ServerCacheEntry* volatile* entryOut) {
+    struct stat st;
+    if (fstat(inputFd, &st) != 0)
+        panic("The input could not be inspected.");
+
+    MappedFileOpenFd(input, inputFd);
+    ImageCheckSize(input->data, input->size);
+
+    // Only regular files (this includes memfds) have a stable identity
+    int cacheable = S_ISREG(st.st_mode);
+
+    ServerCacheEntry* entry = cacheable ? ServerCacheAcquire(&server->cache, &st) : NULL;
+
+    if (entry == NULL) {
+        ImageCreateKTXData(input->data, ktx);
+
+        if (!cacheable) {
+            makeParentDirectories(request->outputPath);
+            ImageExportKTX(input->data, ktx, &request->select, request->outputPath, NULL);
+            return;
+        }
+
+        entry = ServerCacheInsert(&server->cache, &st, ktx);
+    }
+
+    *entryOut = entry;
+
+    makeParentDirectories(request->outputPath);
+    ImageExportKTX(input->data, &entry->ktx, &request->select, request->outputPath, NULL);
+}
+
+// Everything allocated is handed back through buffers, ktx and writerOut as
+// soon as it exists, so the caller can free it after a panic.
+void ServerCreate(Server* server, BatchWorker* worker, ServerRequest* request, MappedFile* input, MappedFile* mask, u8* volatile* buffers, KTXView* ktx, ImageWriter* volatile* writerOut) {
+    int imageWidth, imageHeight;
+    buffers[0] = stbi_load_from_memory(input->data, input->size, &imageWidth, &imageHeight, NULL, 4);
+    if (buffers[0] == NULL)
+        panic("The input image file could not be decoded.");
+
+    int maskWidth = 0, maskHeight = 0;
+
+    if (mask->data != NULL) {
+        buffers[1] = stbi_load_from_memory(mask->data, mask->size, &maskWidth, &maskHeight, NULL, 1);
+        if (buffers[1] == NULL)
+            panic("The input mask image could not be decoded.");
+    }
+
+    makeParentDirectories(request->outputPath);
+
+    ImageWriter* writer = ImageWriterCreate(
+        request->outputPath, worker->cctx, &server->compress,
+        (u16)imageWidth, (u16)imageHeight,
+        KTXGetCreateSize(imageWidth, imageHeight)
+    );
+    *writerOut = writer;
+
+    ImageWriterSetMask(writer, buffers[1], (u16)maskWidth, (u16)maskHeight);
+
+    // Auto needs the whole KTX data to try candidates on
+    if (server->compress.autoBudgetMs != 0) {
+        KTXAllocate(buffers[0], imageWidth, imageHeight, ktx);
+        KTXCreateLevels(ktx, NULL);
+
+        ImageWriterWriteKTXAuto(writer, ktx->data, ktx->size);
+    }
+    else
+        ImageWriterGenerateKTX(writer, buffers[0], NULL);
+
+    ImageWriterFinish(writer);
+}
+
+// Receives one request and up to two descriptors. Returns FALSE on a bad message.
+int ServerReceive(int conn, ServerRequest* request, int* fds, unsigned* fdCount) {
+    struct iovec iov = { .iov_base = request, .iov_len = sizeof(ServerRequest) };
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t received = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+
+    *fdCount = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (unsigned i = 0; i < count && *fdCount < 2; i++)
+            memcpy(&fds[(*fdCount)++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+    }
+
+    if (received != sizeof(ServerRequest) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+        return FALSE;
+    if (request->magic != SERVER_MAGIC)
+        return FALSE;
+
+    request->inputPath[PATH_MAX - 1] = '\0';
+    request->maskPath[PATH_MAX - 1] = '\0';
+    request->outputPath[PATH_MAX - 1] = '\0';
+
+    return TRUE;
+}
+
+void ServerHandleConnection(void* arg, unsigned workerIndex) {
+    ServerConnection* connection = (ServerConnection*)arg;
+    Server* server = connection->server;
+    BatchWorker* worker = &server->workers[workerIndex];
+
+    ServerRequest* request = (ServerRequest*)malloc(sizeof(ServerRequest));
+
+    ServerResponse response;
+    memset(&response, 0, sizeof(response));
+
+    int fds[2] = { -1, -1 };
+    unsigned fdCount = 0;
+
+    if (request == NULL)
+        snprintf(response.message, sizeof(response.message), "Out of memory");
+    else if (!ServerReceive(connection->conn, request, fds, &fdCount))
+        snprintf(response.message, sizeof(response.message), "Malformed request");
+    else {
+        volatile int inputFd = -1;
+        volatile int maskFd = -1;
+
+        unsigned fdIndex = 0;
+        if ((request->fdFlags & SERVER_FD_INPUT) && fdIndex < fdCount)
+            inputFd = fds[fdIndex++];
+        if ((request->fdFlags & SERVER_FD_MASK) && fdIndex < fdCount)
+            maskFd = fds[fdIndex++];
+
+        MappedFile* input = &connection->input;
+        MappedFile* mask = &connection->mask;
+
+        // Descriptors opened here for path-based requests
+        volatile int openedInputFd = -1;
+        volatile int openedMaskFd = -1;
+
+        ServerCacheEntry* volatile entry = NULL;
+        u8* volatile buffers[2] = { NULL, NULL };
+        ImageWriter* volatile writer = NULL;
+
+        jmp_buf recover;
+
+        logQuiet = TRUE;
+        panicRecover = &recover;
+
+        if (setjmp(recover) == 0) {
+            if (inputFd < 0) {
+                if (request->inputPath[0] != '/')
+                    panic("Request paths must be absolute.");
+
+                inputFd = openedInputFd = open(request->inputPath, O_RDONLY | O_CLOEXEC);
+                if (inputFd < 0)
+                    panic("The input file could not be opened.");
+            }
+
+            if (request->outputPath[0] != '/')
+                panic("Request paths must be absolute.");
+
+            if (request->command == SERVER_COMMAND_EXTRACT)
+                ServerExtract(server, request, inputFd, input, &connection->ktx, &entry);
+            else if (request->command == SERVER_COMMAND_CREATE) {
+                if (maskFd < 0 && request->maskPath[0] != '\0') {
+                    if (request->maskPath[0] != '/')
+                        panic("Request paths must be absolute.");
+
+                    maskFd = openedMaskFd = open(request->maskPath, O_RDONLY | O_CLOEXEC);
+                    if (maskFd < 0)
+                        panic("The mask file could not be opened.");
+                }
+
+                MappedFileOpenFd(input, inputFd);
+                if (maskFd >= 0)
+                    MappedFileOpenFd(mask, maskFd);
+
+                ServerCreate(server, worker, request, input, mask, buffers, &connection->ktx, &writer);
+            }
+            else
+                panic("Unknown command.");
+
+            response.ok = TRUE;
+            if (writer != NULL && server->compress.autoBudgetMs != 0) {
+                char note[96];
+                ImageWriterDescribeAuto(writer, note, sizeof(note));
+
+                snprintf(response.message, sizeof(response.message), "OK (%s)", note);
+            }
+            else
+                snprintf(response.message, sizeof(response.message), "OK");
+        }
+        else
+            snprintf(response.message, sizeof(response.message), "%s", panicMessage);
+
+        panicRecover = NULL;
+
+        if (entry != NULL)
+            ServerCacheRelease(&server->cache, entry);
+
+        // Also removes a partial output. Freed first since it may still be reading the mask.
+        if (writer)
+            ImageWriterFree(writer);
+
+        if (buffers[0])
+            stbi_image_free(buffers[0]);
+        if (buffers[1])
+            stbi_image_free(buffers[1]);
+
+        free(connection->ktx.data);
+        connection->ktx.data = NULL;
+
+        MappedFileClose(input);
+        MappedFileClose(mask);
+
+        if (openedInputFd >= 0)
+            close(openedInputFd);
+        if (openedMaskFd >= 0)
+            close(openedMaskFd);
+
+        printf(
+            "%s %s -> %s .. %s\n",
+            request->command == SERVER_COMMAND_CREATE ? "create" : "extract",
+            request->inputPath[0] ? request->inputPath : "<fd>",
+            request->outputPath,
+            response.message
+        );
+    }
+
+    send(connection->conn, &response, sizeof(response), MSG_NOSIGNAL);
+
+    for (unsigned i = 0; i < fdCount; i++)
+        close(fds[i]);
+
+    close(connection->conn);
+
+    free(request);
+    free(connection);
+}
+
+void ServerSignalHandler(int signal) {
+    (void)signal;
+    serverStopping = TRUE;
+}
+
+int ServerBind(const char* socketPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+        panic("The socket path is too long.");
+
+    strcpy(addr.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        panic("The server socket could not be created.");
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (errno != EADDRINUSE)
+            panic("The server socket could not be bound.");
+
+        // Left over from a server that didn't exit cleanly?
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        int inUse = connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(probe);
+
+        if (inUse)
+            panic("Another server is already listening on this socket.");
+
+        unlink(socketPath);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+            panic("The server socket could not be bound.");
+    }
+
+    if (listen(fd, 64) != 0)
+        panic("The server socket could not be listened on.");
+
+    return fd;
+}
+
+// Serves requests until SIGINT or SIGTERM.
+int ServerRun(const char* socketPath, unsigned threadCount, const ImageCompressParams* compress) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+
+    pthread_mutex_init(&server.cache.lock, NULL);
+    server.cache.capacity = SERVER_CACHE_BYTES;
+
+    server.workerCount = threadCount ? threadCount : 1;
+    server.workers = BatchWorkersCreate(server.workerCount);
+    server.compress = *compress;
+
+    int listenFd = ServerBind(socketPath);
+
+    // Workers inherit a blocked mask so signals interrupt accept() below
+    sigset_t stopSignals, oldMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+
+    ThreadPool* pool = ThreadPoolCreate(server.workerCount);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = ServerSignalHandler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    printf("Listening on '%s' with %u worker(s) ..\n", socketPath, server.workerCount);
+
+    while (!serverStopping) {
+        int conn = accept(listenFd, NULL, NULL);
+        if (conn < 0) {
+            if (errno != EINTR)
+                warn("accept() failed.");
+            continue;
+        }
+
+        ServerConnection* connection = (ServerConnection*)calloc(1, sizeof(ServerConnection));
+        if (connection == NULL) {
+            close(conn);
+            continue;
+        }
+
+        connection->server = &server;
+        connection->conn = conn;
+
+        ThreadPoolSubmit(pool, ServerHandleConnection, connection);
+    }
+
+    printf("\nStopping ..");
+
+    close(listenFd);
+    unlink(socketPath);
+
+    ThreadPoolWait(pool);
+    ThreadPoolDestroy(pool);
+
+    LOG_OK;
+
+    printf(
+        "KTX cache: %lu hit(s), %lu miss(es).\n",
+        server.cache.hits, server.cache.misses
+    );
+
+    ServerCacheFree(&server.cache);
+    BatchWorkersFree(server.workers, server.workerCount);
+
+    return 0;
+}
+
+// Relative paths are resolved against the client's working directory.
+void ClientAbsolutePath(char* dst, const char* path) {
+    if (path[0] == '/') {
+        snprintf(dst, PATH_MAX, "%s", path);
+        return;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        panic("The working directory could not be determined.");
+
+    if (snprintf(dst, PATH_MAX, "%s/%s", cwd, path) >= PATH_MAX)
+        panic("The path is too long.");
+}
+
+// Sends one request to a running server. Inputs are passed as open
+// descriptors, so the server reads them without resolving any paths. An
+// input path of "-" passes standard input itself.
+int ClientRun(const char* socketPath, u32 command, char* inputPath, char* maskPath, char* outputPath, const ImageSelect* select) {
+    ServerRequest* request = (ServerRequest*)calloc(1, sizeof(ServerRequest));
+    if (request == NULL)
+        panic("Failed to allocate memory (client request)");
+
+    request->magic = SERVER_MAGIC;
+    request->command = command;
+    request->select = *select;
+
+    int fds[2];
+    unsigned fdCount = 0;
+
+    int inputIsStdin = strcmp(inputPath, "-") == 0;
+
+    fds[fdCount] = inputIsStdin ? STDIN_FILENO : open(inputPath, O_RDONLY | O_CLOEXEC);
+    if (fds[fdCount] < 0)
+        panic("The input file could not be opened.");
+
+    fdCount++;
+    request->fdFlags |= SERVER_FD_INPUT;
+
+    // Left empty for standard input; the server logs it as a descriptor
+    if (!inputIsStdin)
+        ClientAbsolutePath(request->inputPath, inputPath);
+
+    if (maskPath != NULL && command == SERVER_COMMAND_CREATE) {
+        fds[fdCount] = open(maskPath, O_RDONLY | O_CLOEXEC);
+        if (fds[fdCount] < 0)
+            panic("The mask file could not be opened.");
+
+        fdCount++;
+        request->fdFlags |= SERVER_FD_MASK;
+        ClientAbsolutePath(request->maskPath, maskPath);
+    }
+
+    ClientAbsolutePath(request->outputPath, outputPath);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+        panic("The socket path is too long.");
+
+    strcpy(addr.sun_path, socketPath);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        panic("Could not connect to the server. Is it running?");
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = { .iov_base = request, .iov_len = sizeof(ServerRequest) };
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(ServerRequest))
+        panic("The request could not be sent.");
+
+    ServerResponse response;
+    if (recv(sock, &response, sizeof(response), 0) != sizeof(response))
+        panic("The server closed the connection without a response.");
+
+    response.message[sizeof(response.message) - 1] = '\0';
+
+    close(sock);
+    for (unsigned i = inputIsStdin ? 1 : 0; i < fdCount; i++)
+        close(fds[i]);
+
+    free(request);
+
+    if (!response.ok) {
+        printf("Error: %s\n", response.message);
+        return 1;
+    }
+
+    printf("%s\n", response.message);
+    return 0;
+}
+
+#endif
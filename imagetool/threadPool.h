@@ -0,0 +1,283 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+
+#include "common.h"
+
+// Work-stealing pool. Tasks submitted from outside the pool go to a shared
+// FIFO queue. Tasks submitted by a running task go to that worker's own
+// deque: the owner pops its newest task (LIFO, still warm in cache), while
+// idle workers steal the oldest one. A big job can therefore split itself
+// into small tasks that other workers pick up.
+
+typedef void (*ThreadPoolFunc)(void* arg, unsigned workerIndex);
+
+typedef struct {
+    ThreadPoolFunc func;
+    void* arg;
+} ThreadPoolTask;
+
+// Growable ring buffer of tasks
+typedef struct {
+    pthread_mutex_t lock;
+
+    ThreadPoolTask* tasks;
+    unsigned capacity;
+    unsigned head;
+    unsigned count;
+} ThreadPoolQueue;
+
+struct ThreadPool;
+
+typedef struct {
+    struct ThreadPool* pool;
+    unsigned index;
+
+    ThreadPoolQueue deque;
+} ThreadPoolWorker;
+
+typedef struct ThreadPool {
+    pthread_t* threads;
+    ThreadPoolWorker* workers;
+    unsigned threadCount;
+
+    ThreadPoolQueue injector;
+
+    u32 queuedCount;  // Tasks sitting in any queue (atomic)
+    u32 pendingCount; // Tasks queued or running (atomic)
+
+    pthread_mutex_t lock;
+    pthread_cond_t taskCond; // Signalled when a task is queued or the pool stops
+    pthread_cond_t idleCond; // Signalled when the last pending task finishes
+
+    int stopping;
+} ThreadPool;
+
+// Worker the calling thread belongs to, or NULL outside the pool
+__thread ThreadPoolWorker* threadPoolCurrentWorker = NULL;
+
+void ThreadPoolQueueInit(ThreadPoolQueue* queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+
+    queue->capacity = 64;
+    queue->head = 0;
+    queue->count = 0;
+
+    queue->tasks = (ThreadPoolTask*)malloc(queue->capacity * sizeof(ThreadPoolTask));
+    if (queue->tasks == NULL)
+        panic("Failed to allocate memory (thread pool tasks)");
+}
+
+void ThreadPoolQueueFree(ThreadPoolQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->tasks);
+}
+
+void ThreadPoolQueuePushBack(ThreadPoolQueue* queue, ThreadPoolTask task) {
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->count == queue->capacity) {
+        unsigned newCapacity = queue->capacity * 2;
+
+        ThreadPoolTask* newTasks = (ThreadPoolTask*)malloc(newCapacity * sizeof(ThreadPoolTask));
+        if (newTasks == NULL)
+            panic("Failed to allocate memory (thread pool tasks)");
+
+        for (unsigned i = 0; i < queue->count; i++)
+            newTasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+
+        free(queue->tasks);
+
+        queue->tasks = newTasks;
+        queue->capacity = newCapacity;
+        queue->head = 0;
+    }
+
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int ThreadPoolQueuePopBack(ThreadPoolQueue* queue, ThreadPoolTask* taskOut) {
+    pthread_mutex_lock(&queue->lock);
+
+    int found = queue->count != 0;
+    if (found) {
+        queue->count--;
+        *taskOut = queue->tasks[(queue->head + queue->count) % queue->capacity];
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+int ThreadPoolQueuePopFront(ThreadPoolQueue* queue, ThreadPoolTask* taskOut) {
+    pthread_mutex_lock(&queue->lock);
+
+    int found = queue->count != 0;
+    if (found) {
+        *taskOut = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+// Own deque first, then the shared queue, then steal from the others.
+int ThreadPoolFindTask(ThreadPoolWorker* worker, ThreadPoolTask* taskOut) {
+    ThreadPool* pool = worker->pool;
+
+    if (ThreadPoolQueuePopBack(&worker->deque, taskOut))
+        return TRUE;
+    if (ThreadPoolQueuePopFront(&pool->injector, taskOut))
+        return TRUE;
+
+    for (unsigned i = 1; i < pool->threadCount; i++) {
+        ThreadPoolWorker* victim = &pool->workers[(worker->index + i) % pool->threadCount];
+
+        if (ThreadPoolQueuePopFront(&victim->deque, taskOut))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+void* ThreadPoolWorkerMain(void* arg) {
+    ThreadPoolWorker* worker = (ThreadPoolWorker*)arg;
+    ThreadPool* pool = worker->pool;
+
+    threadPoolCurrentWorker = worker;
+
+    while (TRUE) {
+        ThreadPoolTask task;
+
+        if (!ThreadPoolFindTask(worker, &task)) {
+            pthread_mutex_lock(&pool->lock);
+
+            while (__atomic_load_n(&pool->queuedCount, __ATOMIC_ACQUIRE) == 0 && !pool->stopping)
+                pthread_cond_wait(&pool->taskCond, &pool->lock);
+
+            int stop = pool->stopping && __atomic_load_n(&pool->queuedCount, __ATOMIC_ACQUIRE) == 0;
+
+            pthread_mutex_unlock(&pool->lock);
+
+            if (stop)
+                break;
+
+            continue;
+        }
+
+        __atomic_sub_fetch(&pool->queuedCount, 1, __ATOMIC_ACQ_REL);
+
+        task.func(task.arg, worker->index);
+
+        if (__atomic_sub_fetch(&pool->pendingCount, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->idleCond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    threadPoolCurrentWorker = NULL;
+
+    return NULL;
+}
+
+// Must be destroyed after creation
+ThreadPool* ThreadPoolCreate(unsigned threadCount) {
+    if (threadCount == 0)
+        threadCount = 1;
+
+    ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL)
+        panic("Failed to allocate memory (thread pool)");
+
+    pool->threadCount = threadCount;
+    pool->threads = (pthread_t*)calloc(threadCount, sizeof(pthread_t));
+    pool->workers = (ThreadPoolWorker*)calloc(threadCount, sizeof(ThreadPoolWorker));
+
+    if (pool->threads == NULL || pool->workers == NULL)
+        panic("Failed to allocate memory (thread pool)");
+
+    ThreadPoolQueueInit(&pool->injector);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->taskCond, NULL);
+    pthread_cond_init(&pool->idleCond, NULL);
+
+    for (unsigned i = 0; i < threadCount; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+
+        ThreadPoolQueueInit(&pool->workers[i].deque);
+    }
+
+    for (unsigned i = 0; i < threadCount; i++) {
+        if (pthread_create(&pool->threads[i], NULL, ThreadPoolWorkerMain, &pool->workers[i]) != 0)
+            panic("Failed to create worker thread");
+    }
+
+    return pool;
+}
+
+// May be called from inside a task; the new task then goes to the calling
+// worker's deque where idle workers can steal it.
+void ThreadPoolSubmit(ThreadPool* pool, ThreadPoolFunc func, void* arg) {
+    ThreadPoolTask task = { .func = func, .arg = arg };
+
+    __atomic_add_fetch(&pool->pendingCount, 1, __ATOMIC_ACQ_REL);
+
+    ThreadPoolWorker* worker = threadPoolCurrentWorker;
+    if (worker != NULL && worker->pool == pool)
+        ThreadPoolQueuePushBack(&worker->deque, task);
+    else
+        ThreadPoolQueuePushBack(&pool->injector, task);
+
+    __atomic_add_fetch(&pool->queuedCount, 1, __ATOMIC_ACQ_REL);
+
+    // Taking the lock orders this against a worker about to sleep
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->taskCond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Blocks until every submitted task (including tasks they submitted) has finished.
+void ThreadPoolWait(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    while (__atomic_load_n(&pool->pendingCount, __ATOMIC_ACQUIRE) != 0)
+        pthread_cond_wait(&pool->idleCond, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ThreadPoolDestroy(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = TRUE;
+    pthread_cond_broadcast(&pool->taskCond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (unsigned i = 0; i < pool->threadCount; i++)
+        ThreadPoolQueueFree(&pool->workers[i].deque);
+
+    ThreadPoolQueueFree(&pool->injector);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->taskCond);
+    pthread_cond_destroy(&pool->idleCond);
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+#endif